@@ -1,5 +1,145 @@
 #include "lg-monoblock-modbus-state-machine.h"
+#ifdef USE_WEB_SERVER
+#include "esphome/components/web_server_base/web_server_base.h"
+#endif // USE_WEB_SERVER
 
+#ifdef LG_COUNT_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+#endif // LG_COUNT_ALLOCATIONS
+
+#ifdef LG_COUNT_ALLOCATIONS
+// host builds only: count every operator new of the program to find allocations in run_cycle
+static std::atomic<uint32_t> allocation_counter{0};
+void *operator new(size_t size)
+{
+    allocation_counter.fetch_add(1, std::memory_order_relaxed);
+    void *pointer = malloc(size ? size : 1);
+    if (pointer == nullptr)
+        throw std::bad_alloc();
+    return pointer;
+}
+void operator delete(void *pointer) noexcept
+{
+    free(pointer);
+}
+void operator delete(void *pointer, size_t) noexcept
+{
+    free(pointer);
+}
+#endif // LG_COUNT_ALLOCATIONS
+static inline uint32_t allocation_count()
+{
+#ifdef LG_COUNT_ALLOCATIONS
+    return allocation_counter.load(std::memory_order_relaxed);
+#else
+    return 0;
+#endif // LG_COUNT_ALLOCATIONS
+}
+// other tasks (web server, api) allocate too, a heap shrink during run_cycle is a hint, the host count is exact
+static inline uint32_t free_heap()
+{
+#ifdef ARDUINO_ARCH_ESP32
+    return ESP.getFreeHeap();
+#else
+    return 0;
+#endif // ARDUINO_ARCH_ESP32
+}
+
+#ifdef LG_FIXED_POINT_CONTROL
+// Q16.16 fixed point for the control math. Build with -DLG_FIXED_POINT_CONTROL to get bit identical results on host and ESP32:
+// no libm (pow), no float multiply/divide of control values and no fused multiply-add contraction. This does not take the
+// FPU out of the cycle: inputs, config and thresholds stay float, to_q16 converts them at every use and the state
+// decisions compare floats. The conversions only scale by 2^16 and round, which is exact and the same on every target.
+// Results are converted back to float, Q16.16 values below 128 are exact in a float so stored values are identical too
+typedef int32_t q16_t;
+static const q16_t q16_one = 1 << 16;
+static inline q16_t to_q16(float value)
+{
+    return (q16_t)lroundf(value * 65536.0f);
+}
+static inline float from_q16(q16_t value)
+{
+    return value / 65536.0f;
+}
+static inline q16_t q16_mul(q16_t a, q16_t b)
+{
+    return (q16_t)(((int64_t)a * b) >> 16);
+}
+static inline q16_t q16_div(q16_t a, q16_t b)
+{
+    return (q16_t)(((int64_t)a << 16) / b);
+}
+// round half away from zero like round()
+static inline q16_t q16_round(q16_t value)
+{
+    if (value >= 0)
+        return (value + q16_one / 2) & ~(q16_one - 1);
+    return -((-value + q16_one / 2) & ~(q16_one - 1));
+}
+#endif // LG_FIXED_POINT_CONTROL
+// holding register 2 takes whole degrees, a pendel target derived from the full resolution tracking value is floored to it
+static inline float register_temp(float value)
+{
+    return floor(value);
+}
+
+// histogram bucket bounds in microseconds
+static const uint32_t cycle_time_bounds[histogram_struct::bucket_count - 1] = {1000, 2000, 5000, 10000, 20000, 50000, 100000, 250000};
+static const uint32_t modbus_latency_bounds[histogram_struct::bucket_count - 1] = {5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000};
+static const uint32_t handoff_latency_bounds[histogram_struct::bucket_count - 1] = {100, 500, 1000, 2000, 5000, 10000, 20000, 50000};
+static const char *const cycle_phase_names[5] = {"receive_inputs", "process_inputs", "state", "set_target_temp", "handle_state_transition"};
+static const char *const input_type_names[16] = {"THERMOSTAT", "THERMOSTAT_SENSOR", "COMPRESSOR", "SWW_RUN", "DEFROST_RUN", "OAT", "STOOKLIJN_TARGET", "TRACKING_VALUE", "BOOST", "BACKUP_HEAT", "EXTERNAL_PUMP", "RELAY_HEAT", "TEMP_NEW_TARGET", "WP_PUMP", "SILENT_MODE", "EMERGENCY"};
+// host builds with LG_PUBLISH_UNBATCHED publish every value when it is made, the golden traces must be the same
+#ifdef LG_PUBLISH_UNBATCHED
+static const bool publish_unbatched = true;
+#else
+static const bool publish_unbatched = false;
+#endif // LG_PUBLISH_UNBATCHED
+// actuators (up to OUTPUT_WATER_TEMP_TARGET) are never held back
+static const publish_policy_struct publish_policies[OUTPUT_CONTROLLER_INFO + 1] = {
+    {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0},
+    {0, 0},         // OUTPUT_SILENT_MODE_STATE
+    {0, 0},         // OUTPUT_DOEL_TEMP
+    {0.1, 2 * 60},  // OUTPUT_DERIVATIVE_VALUE, degrees per hour
+    {0, 0},         // OUTPUT_WATERTEMP_TARGET
+    {1, 5 * 60},    // OUTPUT_DEFROST_PREDICTION, minutes
+    {0.1, 5 * 60},  // OUTPUT_ROOM_COMPENSATION_VALUE
+    {1, 30 * 60},   // OUTPUT_BUILDING_HEAT_LOSS_VALUE, W/K
+    {0.1, 30 * 60}, // OUTPUT_BUILDING_TIME_CONSTANT_VALUE, hours
+    {0, 0},         // OUTPUT_CONTROLLER_STATE, only the same state twice is dropped
+    {0, 0}};        // OUTPUT_CONTROLLER_INFO, only the same message twice is dropped
+static const char *const sensor_names[SENSOR_COUNT] = {"compressor_running", "defrosting", "sww_heating", "pump_running", "water_temp_aanvoer", "water_temp_retour", "buiten_temp", "compressor_hz", "current_flow_rate"};
+static const char *const profile_point_names[5] = {"receive_inputs", "thermostat_state", "calculate_derivative", "calculate_stooklijn", "check_change_events"};
+static const char *const cause_names[CAUSE_UNKNOWN - CAUSE_INIT_DONE + 1] = {"INIT_DONE", "THERMOSTAT_ON", "START_DONE", "COMPRESSOR_ON", "STABILIZED", "BELOW_TARGET", "ABOVE_TARGET", "PREDICTED_OVERSHOOT", "PREDICTED_STALL", "OVERSHOOT_CONTAINED", "STALL_RECOVERED", "SWW_DONE", "DEFROST_DONE", "AFTERRUN_DONE", "UNKNOWN"};
+// metrics and transition trace live outside the state machine so the web server can read them without touching controller state
+static metrics_struct metrics;
+static transition_trace_struct transition_trace;
+// text sensors take a std::string, the buffer keeps its capacity so publishing a message does not allocate after boot
+// (defined before fsm, the constructor reserves it)
+static std::string output_text_buffer;
+// main state machine object
+static state_machine_class fsm;
+
+input_table_struct::input_table_struct()
+{
+    for (input_struct &item : inputs)
+        item.run_time = &run_time;
+}
+input_table_struct::input_table_struct(const input_table_struct &other)
+{
+    *this = other;
+}
+input_table_struct &input_table_struct::operator=(const input_table_struct &other)
+{
+    run_time = other.run_time;
+    for (int i = 0; i < 16; i++)
+    {
+        inputs[i] = other.inputs[i];
+        inputs[i].run_time = &run_time;
+    }
+    return *this;
+}
 input_struct::input_struct(uint_fast32_t *run_time_pointer)
 {
     run_time = run_time_pointer;
@@ -29,46 +169,567 @@ void input_struct::unflag()
     prev_state = state;
     prev_value = value;
 }
+// replace a nan or out of range value by its default, returns false if replaced
+static bool validate_value(float &value, float min_value, float max_value, float default_value)
+{
+    if (isnan(value) || value < min_value || value > max_value)
+    {
+        value = default_value;
+        return false;
+    }
+    return true;
+}
+// ranges are the min/max of the template numbers in base.yml
+bool config_struct::validate()
+{
+    const config_struct defaults;
+    bool valid = true;
+    valid &= validate_value(stooklijn_min_oat, -20, 10, defaults.stooklijn_min_oat);
+    valid &= validate_value(stooklijn_max_oat, 0, 20, defaults.stooklijn_max_oat);
+    valid &= validate_value(stooklijn_max_wtemp, 22, 55, defaults.stooklijn_max_wtemp);
+    valid &= validate_value(stooklijn_min_wtemp, 22, 55, defaults.stooklijn_min_wtemp);
+    valid &= validate_value(wp_stooklijn_offset, -4, 4, defaults.wp_stooklijn_offset);
+    valid &= validate_value(stooklijn_curve, -6, 6, defaults.stooklijn_curve);
+    valid &= validate_value(minimum_run_time, 0, 60, defaults.minimum_run_time);
+    valid &= validate_value(external_pump_runover, 0, 60, defaults.external_pump_runover);
+    valid &= validate_value(oat_silent_always_off, -20, 10, defaults.oat_silent_always_off);
+    valid &= validate_value(oat_silent_always_on, -20, 20, defaults.oat_silent_always_on);
+    valid &= validate_value(backup_heater_always_on_temp, -30, 20, defaults.backup_heater_always_on_temp);
+    valid &= validate_value(backup_heater_active_temp, -30, 20, defaults.backup_heater_active_temp);
+    valid &= validate_value(thermostat_off_delay, 0, 10, defaults.thermostat_off_delay);
+    valid &= validate_value(thermostat_on_delay, 0, 10, defaults.thermostat_on_delay);
+    valid &= validate_value(boost_time, 0, 180, defaults.boost_time);
+    valid &= validate_value(room_temp_target, 10, 30, defaults.room_temp_target);
+    // the stooklijn needs a range to interpolate over (Z divides by min_oat - max_oat)
+    if (stooklijn_min_oat >= stooklijn_max_oat)
+    {
+        stooklijn_min_oat = defaults.stooklijn_min_oat;
+        stooklijn_max_oat = defaults.stooklijn_max_oat;
+        valid = false;
+    }
+    if (stooklijn_min_wtemp > stooklijn_max_wtemp)
+    {
+        stooklijn_min_wtemp = defaults.stooklijn_min_wtemp;
+        stooklijn_max_wtemp = defaults.stooklijn_max_wtemp;
+        valid = false;
+    }
+    return valid;
+}
+int defrost_predictor_struct::bucket(float oat)
+{
+    if (isnan(oat) || oat < -12.5 || oat >= 7.5)
+        return -1;
+    return (int)((oat + 12.5) / 2.5);
+}
+void defrost_predictor_struct::update(uint_fast32_t run_time, bool compressor, bool defrost, float oat, float compressor_hz, uint_fast32_t window)
+{
+    uint_fast32_t dt = run_time - last_update_time;
+    last_update_time = run_time;
+    load_rate = 0;
+    predicted_seconds = -1;
+    // no frost is collected during defrost (the outdoor coil is heated)
+    if (defrost)
+        return;
+    // frost load is compressor run time weighted by compressor frequency (50Hz = 1 per second)
+    if (compressor && compressor_hz > 0)
+    {
+        load_rate = compressor_hz / 50;
+        load += load_rate * dt;
+    }
+    // only predict when the load is counted from the previous defrost and this bucket has been learned
+    int b = bucket(oat);
+    if (!load_valid || b < 0 || learned_load[b] == 0 || load_rate == 0)
+        return;
+    float remaining = learned_load[b] - load;
+    predicted_seconds = remaining > 0 ? (int_fast32_t)(remaining / load_rate) : 0;
+    // remember the predicted defrost time when entering the window to measure accuracy
+    if (predicted_time == 0 && predicted_seconds <= (int_fast32_t)window)
+        predicted_time = run_time + predicted_seconds;
+}
+void defrost_predictor_struct::defrost_start(uint_fast32_t run_time, float oat)
+{
+    defrost_count++;
+    if (predicted_time != 0)
+    {
+        predicted_count++;
+        float error = fabs((float)run_time - (float)predicted_time);
+        mean_abs_error = (predicted_count == 1) ? error : (mean_abs_error * 0.8 + error * 0.2);
+        ESP_LOGD("defrost_predictor", "Defrost predicted at: %u actual: %u error: %f s mean error: %f s (%u/%u predicted)", (unsigned)predicted_time, (unsigned)run_time, error, mean_abs_error, (unsigned)predicted_count, (unsigned)defrost_count);
+    }
+    else
+    {
+        ESP_LOGD("defrost_predictor", "Defrost not predicted, load: %f oat: %f (%u/%u predicted)", load, oat, (unsigned)predicted_count, (unsigned)defrost_count);
+    }
+    // learn the load of this interval (moving average), first interval after boot is incomplete
+    int b = bucket(oat);
+    if (load_valid && b >= 0 && load > 0)
+    {
+        learned_load[b] = (learned_load[b] == 0) ? load : (learned_load[b] * 0.7 + load * 0.3);
+    }
+    predicted_time = 0;
+}
+void defrost_predictor_struct::defrost_end()
+{
+    load = 0;
+    load_valid = true;
+    predicted_time = 0;
+}
+// accumulate averages over sample_time, then fit the sample. Invalid readings are skipped
+void building_model_struct::update(uint_fast32_t run_time, float oat, float room, float supply, float retour, float flow)
+{
+    if (isnan(oat) || isnan(room) || isnan(supply) || isnan(retour) || isnan(flow))
+        return;
+    if (count == 0)
+        sample_start = run_time;
+    // heat delivered in kW: flow (l/min) * 4.186 kJ/(l K) / 60 * (supply - retour)
+    heat_sum += flow * 4.186 / 60 * (supply - retour);
+    oat_sum += oat;
+    water_sum += (supply + retour) / 2;
+    room_sum += room;
+    count++;
+    if (run_time - sample_start < (uint_fast32_t)sample_time)
+        return;
+    // fit the change of the average room temperature between two samples against the inputs averaged over both
+    // averaging hides the 0.1 degree resolution of the room temperature
+    float room_average = room_sum / count;
+    float oat_average = oat_sum / count;
+    float heat_average = heat_sum / count;
+    if (!isnan(prev_room))
+        fit((oat_average + prev_oat) / 2, (room_average + prev_room) / 2, room_average, water_sum / count, (heat_average + prev_heat) / 2, heat_average, room_average - prev_room, (run_time - sample_start) / 3600.0);
+    prev_room = room_average;
+    prev_oat = oat_average;
+    prev_heat = heat_average;
+    heat_sum = oat_sum = water_sum = room_sum = 0;
+    count = 0;
+}
+void building_model_struct::fit(float oat, float room, float emitter_room, float water, float heat, float emitter_heat, float room_change, float hours)
+{
+    // room model: room_change = a * (oat - room) * hours + b * heat * hours
+    const float phi[2] = {(oat - room) * hours, heat * hours};
+    const float Pphi[2] = {P[0][0] * phi[0] + P[0][1] * phi[1], P[1][0] * phi[0] + P[1][1] * phi[1]};
+    const float denominator = forgetting + phi[0] * Pphi[0] + phi[1] * Pphi[1];
+    const float gain[2] = {Pphi[0] / denominator, Pphi[1] / denominator};
+    const float error = room_change - (theta[0] * phi[0] + theta[1] * phi[1]);
+    theta[0] += gain[0] * error;
+    theta[1] += gain[1] * error;
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < 2; j++)
+            P[i][j] = (P[i][j] - gain[i] * Pphi[j]) / forgetting;
+    }
+    // emitter model on the averages of this sample only, informative while heat is delivered
+    const float water_delta = water - emitter_room;
+    if (emitter_heat > 0.1 && water_delta > 1)
+    {
+        const float k_gain = k_P * water_delta / (forgetting + water_delta * k_P * water_delta);
+        k += k_gain * (emitter_heat - k * water_delta);
+        k_P = (k_P - k_gain * water_delta * k_P) / forgetting;
+    }
+    samples++;
+    ESP_LOGD("building_model", "Sample %u: heat loss %f W/K, time constant %f h, emitters %f kW/K", (unsigned)samples, heat_loss(), time_constant(), k);
+}
+bool building_model_struct::valid()
+{
+    return samples >= (uint32_t)min_samples && theta[0] > 0 && theta[1] > 0 && k > 0;
+}
+float building_model_struct::heat_loss()
+{
+    return theta[1] > 0 ? theta[0] / theta[1] * 1000 : NAN;
+}
+float building_model_struct::time_constant()
+{
+    return theta[0] > 0 ? 1 / theta[0] : NAN;
+}
+// mean water temperature that delivers the steady state heat loss at this oat, nan if the model is not valid
+float building_model_struct::supply_temp(float room_target, float oat)
+{
+    if (!valid())
+        return NAN;
+    return room_target + (theta[0] / theta[1]) * (room_target - oat) / k;
+}
+// restore a persisted model, the covariance restarts small so the fit adapts without forgetting the model
+void building_model_struct::load(float heat_loss_value, float time_constant_value, float emitter_value, uint32_t sample_count)
+{
+    if (!(heat_loss_value > 0) || !(time_constant_value > 0) || !(emitter_value > 0))
+        return;
+    theta[0] = 1 / time_constant_value;
+    theta[1] = theta[0] / (heat_loss_value / 1000);
+    k = emitter_value;
+    P[0][0] = P[1][1] = 0.01;
+    P[0][1] = P[1][0] = 0;
+    k_P = 0.01;
+    samples = sample_count;
+}
+histogram_struct::histogram_struct(const uint32_t *bucket_bounds)
+{
+    // default to the cycle time buckets
+    bounds = bucket_bounds ? bucket_bounds : cycle_time_bounds;
+}
+void histogram_struct::observe(uint32_t value)
+{
+    int i = 0;
+    while (i < bucket_count - 1 && value > bounds[i])
+        i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    // only the control loop observes, so load and store is enough for min/max
+    if (value < min_value.load(std::memory_order_relaxed))
+        min_value.store(value, std::memory_order_relaxed);
+    if (value > max_value.load(std::memory_order_relaxed))
+        max_value.store(value, std::memory_order_relaxed);
+}
+// upper bound of the bucket that holds the given fraction of observations (max for the +Inf bucket)
+uint32_t histogram_struct::percentile(float fraction)
+{
+    uint32_t total = count.load(std::memory_order_relaxed);
+    if (total == 0)
+        return 0;
+    uint32_t rank = (uint32_t)ceil(total * fraction);
+    uint32_t cumulative = 0;
+    for (int i = 0; i < bucket_count - 1; i++)
+    {
+        cumulative += buckets[i].load(std::memory_order_relaxed);
+        if (cumulative >= rank)
+            return std::min(bounds[i], max_value.load(std::memory_order_relaxed));
+    }
+    return max_value.load(std::memory_order_relaxed);
+}
+metrics_struct::metrics_struct() : cycle_time_us(cycle_time_bounds), modbus_latency_us(modbus_latency_bounds), handoff_latency_us(handoff_latency_bounds)
+{
+}
+void metrics_struct::add(std::atomic<uint32_t> &counter, uint32_t n)
+{
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+// observe the time since start for a cycle phase and return the start of the next phase
+uint32_t metrics_struct::lap(cycle_phases phase, uint32_t start)
+{
+    uint32_t now = micros();
+    phase_time_us[phase].observe(now - start);
+    return now;
+}
+// CPU cycles where the core has a cycle counter, the function profiles are too short for micros()
+static inline uint32_t profile_clock()
+{
+#ifdef ARDUINO_ARCH_ESP32
+    return ESP.getCycleCount();
+#else
+    return micros();
+#endif // ARDUINO_ARCH_ESP32
+}
+void profile_struct::observe(uint32_t ticks)
+{
+    sum.fetch_add(ticks, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    uint32_t current = max_value.load(std::memory_order_relaxed);
+    if (ticks > current)
+        max_value.store(ticks, std::memory_order_relaxed);
+}
+profile_scope_struct::profile_scope_struct(profile_struct &target) : profile(target), start(profile_clock())
+{
+}
+profile_scope_struct::~profile_scope_struct()
+{
+    profile.observe(profile_clock() - start);
+}
+// the samples of the summary (sum and count), or the max gauge
+static void print_profile(std::string &out, bool max_only, const char *label, const char *name, profile_struct &profile)
+{
+    char line[128];
+    if (max_only)
+    {
+        snprintf(line, sizeof(line), "lg_profile_ticks_max{%s=\"%s\"} %u\n", label, name, (unsigned)profile.max_value.load(std::memory_order_relaxed));
+        out += line;
+        return;
+    }
+    snprintf(line, sizeof(line), "lg_profile_ticks_sum{%s=\"%s\"} %u\n", label, name, (unsigned)profile.sum.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "lg_profile_ticks_count{%s=\"%s\"} %u\n", label, name, (unsigned)profile.count.load(std::memory_order_relaxed));
+    out += line;
+}
+static void print_histogram(std::string &out, const char *name, const char *help, histogram_struct &histogram)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    out += line;
+    uint32_t cumulative = 0;
+    for (int i = 0; i < histogram_struct::bucket_count; i++)
+    {
+        cumulative += histogram.buckets[i].load(std::memory_order_relaxed);
+        if (i < histogram_struct::bucket_count - 1)
+            snprintf(line, sizeof(line), "%s_bucket{le=\"%u\"} %u\n", name, (unsigned)histogram.bounds[i], (unsigned)cumulative);
+        else
+            snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %u\n", name, (unsigned)cumulative);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%s_sum %u\n%s_count %u\n", name, (unsigned)histogram.sum.load(std::memory_order_relaxed), name, (unsigned)histogram.count.load(std::memory_order_relaxed));
+    out += line;
+}
+// print all metrics in prometheus text format
+void metrics_struct::print(std::string &out)
+{
+    char line[128];
+    out.reserve(4096);
+    print_histogram(out, "lg_run_cycle_duration_us", "Execution time of run_cycle", cycle_time_us);
+    print_histogram(out, "lg_modbus_write_duration_us", "Duration of modbus target writes", modbus_latency_us);
+    print_histogram(out, "lg_handoff_latency_us", "Sensor capture to applied output (LG_DUAL_CORE)", handoff_latency_us);
+    out += "# HELP lg_cycle_phase_duration_us Execution time per run_cycle phase (total is the whole cycle)\n# TYPE lg_cycle_phase_duration_us summary\n";
+    // one sample per snprintf, the phase names leave no room for two in a line buffer
+    for (int i = 0; i <= PHASE_TRANSITION + 1; i++)
+    {
+        histogram_struct &histogram = (i <= PHASE_TRANSITION) ? phase_time_us[i] : cycle_time_us;
+        const char *phase = (i <= PHASE_TRANSITION) ? cycle_phase_names[i] : "total";
+        snprintf(line, sizeof(line), "lg_cycle_phase_duration_us{phase=\"%s\",quantile=\"0.99\"} %u\n", phase, (unsigned)histogram.percentile(0.99));
+        out += line;
+        snprintf(line, sizeof(line), "lg_cycle_phase_duration_us_sum{phase=\"%s\"} %u\n", phase, (unsigned)histogram.sum.load(std::memory_order_relaxed));
+        out += line;
+        snprintf(line, sizeof(line), "lg_cycle_phase_duration_us_count{phase=\"%s\"} %u\n", phase, (unsigned)histogram.count.load(std::memory_order_relaxed));
+        out += line;
+    }
+    // samples of a family stay together, min and max are families of their own
+    out += "# TYPE lg_cycle_phase_min_us gauge\n";
+    for (int i = 0; i <= PHASE_TRANSITION + 1; i++)
+    {
+        histogram_struct &histogram = (i <= PHASE_TRANSITION) ? phase_time_us[i] : cycle_time_us;
+        uint32_t n = histogram.count.load(std::memory_order_relaxed);
+        snprintf(line, sizeof(line), "lg_cycle_phase_min_us{phase=\"%s\"} %u\n", (i <= PHASE_TRANSITION) ? cycle_phase_names[i] : "total", (unsigned)(n ? histogram.min_value.load(std::memory_order_relaxed) : 0));
+        out += line;
+    }
+    out += "# TYPE lg_cycle_phase_max_us gauge\n";
+    for (int i = 0; i <= PHASE_TRANSITION + 1; i++)
+    {
+        histogram_struct &histogram = (i <= PHASE_TRANSITION) ? phase_time_us[i] : cycle_time_us;
+        snprintf(line, sizeof(line), "lg_cycle_phase_max_us{phase=\"%s\"} %u\n", (i <= PHASE_TRANSITION) ? cycle_phase_names[i] : "total", (unsigned)histogram.max_value.load(std::memory_order_relaxed));
+        out += line;
+    }
+    snprintf(line, sizeof(line), "# TYPE lg_invariant_violations_total counter\nlg_invariant_violations_total %u\n", (unsigned)invariant_violations.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_cycle_overruns_total counter\nlg_cycle_overruns_total %u\n", (unsigned)cycle_overruns.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_cycle_allocations_total counter\nlg_cycle_allocations_total %u\n", (unsigned)cycle_allocations.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_cycle_heap_shrink_bytes_total counter\nlg_cycle_heap_shrink_bytes_total %u\n", (unsigned)heap_shrink_bytes.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_allocating_cycles_total counter\nlg_allocating_cycles_total %u\n", (unsigned)allocating_cycles.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_heap_free_bytes gauge\nlg_heap_free_bytes %u\n", (unsigned)heap_free.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_cycle_missed_periods_total counter\nlg_cycle_missed_periods_total %u\n", (unsigned)missed_periods.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_modbus_writes_coalesced_total counter\nlg_modbus_writes_coalesced_total %u\n", (unsigned)modbus_writes_coalesced.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_modbus_write_retries_total counter\nlg_modbus_write_retries_total %u\n", (unsigned)modbus_write_retries.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_modbus_write_failures_total counter\nlg_modbus_write_failures_total %u\n", (unsigned)modbus_write_failures.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_modbus_writes_held_total counter\nlg_modbus_writes_held_total %u\n", (unsigned)modbus_writes_held.load(std::memory_order_relaxed));
+    out += line;
+    out += "# HELP lg_external_overrides_total Controller writes changed on the LG remote\n# TYPE lg_external_overrides_total counter\n";
+    for (input_types actuator : {TEMP_NEW_TARGET, SILENT_MODE})
+    {
+        snprintf(line, sizeof(line), "lg_external_overrides_total{actuator=\"%s\"} %u\n", input_type_names[actuator], (unsigned)external_overrides[actuator].load(std::memory_order_relaxed));
+        out += line;
+    }
+    snprintf(line, sizeof(line), "# TYPE lg_override_reasserts_total counter\nlg_override_reasserts_total %u\n", (unsigned)override_reasserts.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_sequence_resumes_total counter\nlg_sequence_resumes_total %u\n", (unsigned)sequence_resumes.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_sequence_pool_exhausted_total counter\nlg_sequence_pool_exhausted_total %u\n", (unsigned)sequence_pool_exhausted.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_timers_fired_total counter\nlg_timers_fired_total %u\n", (unsigned)timers_fired.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_snapshots_dropped_total counter\nlg_snapshots_dropped_total %u\n", (unsigned)snapshots_dropped.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_publishes_total counter\nlg_publishes_total %u\n", (unsigned)publishes.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_publishes_suppressed_total counter\nlg_publishes_suppressed_total %u\n", (unsigned)publishes_suppressed.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_stale_cycles_total counter\nlg_stale_cycles_total %u\n", (unsigned)stale_cycles.load(std::memory_order_relaxed));
+    out += line;
+    out += "# HELP lg_signal_outliers_total Modbus reads replaced by the median filter\n# TYPE lg_signal_outliers_total counter\n";
+    for (input_types signal : {OAT, TRACKING_VALUE})
+    {
+        snprintf(line, sizeof(line), "lg_signal_outliers_total{input=\"%s\"} %u\n", input_type_names[signal], (unsigned)signal_outliers[signal].load(std::memory_order_relaxed));
+        out += line;
+    }
+    out += "# HELP lg_stale_refusals_total Cycles refused per stale sensor\n# TYPE lg_stale_refusals_total counter\n";
+    for (snapshot_sensors sensor : {SENSOR_COMPRESSOR_RUNNING, SENSOR_DEFROSTING, SENSOR_WATER_TEMP_AANVOER})
+    {
+        snprintf(line, sizeof(line), "lg_stale_refusals_total{sensor=\"%s\"} %u\n", sensor_names[sensor], (unsigned)stale_refusals[sensor].load(std::memory_order_relaxed));
+        out += line;
+    }
+    snprintf(line, sizeof(line), "# TYPE lg_defrosts_predicted_total counter\nlg_defrosts_predicted_total %u\n", (unsigned)defrosts_predicted.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_defrosts_missed_total counter\nlg_defrosts_missed_total %u\n", (unsigned)defrosts_missed.load(std::memory_order_relaxed));
+    out += line;
+    out += "# HELP lg_defrost_prediction_error_seconds Moving average of the absolute defrost prediction error\n";
+    snprintf(line, sizeof(line), "# TYPE lg_defrost_prediction_error_seconds gauge\nlg_defrost_prediction_error_seconds %u\n", (unsigned)defrost_prediction_error_s.load(std::memory_order_relaxed));
+    out += line;
+    out += "# HELP lg_state_seconds_total Time spent per state\n# TYPE lg_state_seconds_total counter\n";
+    for (int i = INIT; i <= AFTERRUN; i++)
+    {
+        snprintf(line, sizeof(line), "lg_state_seconds_total{state=\"%s\"} %u\n", fsm.state_name((states)i), (unsigned)state_seconds[i].load(std::memory_order_relaxed));
+        out += line;
+    }
+    out += "# HELP lg_state_transitions_total State transitions per state pair\n# TYPE lg_state_transitions_total counter\n";
+    for (int from = NONE; from <= AFTERRUN; from++)
+    {
+        for (int to = INIT; to <= AFTERRUN; to++)
+        {
+            uint32_t n = transitions[from][to].load(std::memory_order_relaxed);
+            // skip pairs that never happened, 169 mostly empty series are of no use
+            if (n == 0)
+                continue;
+            snprintf(line, sizeof(line), "lg_state_transitions_total{from=\"%s\",to=\"%s\"} %u\n", from == NONE ? "NONE" : fsm.state_name((states)from), fsm.state_name((states)to), (unsigned)n);
+            out += line;
+        }
+    }
+    out += "# HELP lg_events_fired_total Events that acted in check_change_events\n# TYPE lg_events_fired_total counter\n";
+    for (int i = THERMOSTAT; i <= EMERGENCY; i++)
+    {
+        snprintf(line, sizeof(line), "lg_events_fired_total{input=\"%s\"} %u\n", input_type_names[i], (unsigned)events_fired[i].load(std::memory_order_relaxed));
+        out += line;
+    }
+    out += "# HELP lg_actuator_writes_total Writes to relays, coils and the modbus target\n# TYPE lg_actuator_writes_total counter\n";
+    const input_types actuators[6] = {RELAY_HEAT, EXTERNAL_PUMP, BACKUP_HEAT, BOOST, SILENT_MODE, TEMP_NEW_TARGET};
+    for (input_types actuator : actuators)
+    {
+        snprintf(line, sizeof(line), "lg_actuator_writes_total{actuator=\"%s\"} %u\n", input_type_names[actuator], (unsigned)actuator_writes[actuator].load(std::memory_order_relaxed));
+        out += line;
+    }
+    out += "# HELP lg_actuator_deferred_total Switches delayed by the actuator dwell or rate limit\n# TYPE lg_actuator_deferred_total counter\n";
+    for (input_types actuator : {RELAY_HEAT, EXTERNAL_PUMP, BACKUP_HEAT, SILENT_MODE})
+    {
+        snprintf(line, sizeof(line), "lg_actuator_deferred_total{actuator=\"%s\"} %u\n", input_type_names[actuator], (unsigned)actuator_deferred[actuator].load(std::memory_order_relaxed));
+        out += line;
+    }
+    snprintf(line, sizeof(line), "# TYPE lg_backup_heat_seconds_total counter\nlg_backup_heat_seconds_total %u\n", (unsigned)backup_heat_seconds.load(std::memory_order_relaxed));
+    out += line;
+    out += "# HELP lg_trace_digest Digest of all transitions and actuator writes, compare replays against a golden run\n# TYPE lg_trace_digest gauge\n";
+    snprintf(line, sizeof(line), "lg_trace_digest %u\n", (unsigned)transition_trace.digest.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_modbus_read_errors_total counter\nlg_modbus_read_errors_total %u\n", (unsigned)modbus_read_errors.load(std::memory_order_relaxed));
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE lg_stooklijn_recalculations_total counter\nlg_stooklijn_recalculations_total %u\n", (unsigned)stooklijn_recalculations.load(std::memory_order_relaxed));
+    out += line;
+#ifdef ARDUINO_ARCH_ESP32
+    out += "# HELP lg_profile_ticks Cost of the hot paths and of run_cycle per state in CPU cycles (mean is sum / count)\n# TYPE lg_profile_ticks summary\n";
+#else
+    out += "# HELP lg_profile_ticks Cost of the hot paths and of run_cycle per state in microseconds (mean is sum / count)\n# TYPE lg_profile_ticks summary\n";
+#endif // ARDUINO_ARCH_ESP32
+    for (bool max_only : {false, true})
+    {
+        // a summary has no max, it is a gauge of its own
+        if (max_only)
+            out += "# TYPE lg_profile_ticks_max gauge\n";
+        for (int i = PROFILE_RECEIVE_INPUTS; i <= PROFILE_CHECK_CHANGE_EVENTS; i++)
+            print_profile(out, max_only, "function", profile_point_names[i], functions[i]);
+        for (int i = INIT; i <= AFTERRUN; i++)
+            print_profile(out, max_only, "state", fsm.state_name((states)i), state_cycles[i]);
+    }
+}
+// name of a transition cause, events are named after their input
+static const char *cause_name(uint8_t cause)
+{
+    if (cause < CAUSE_INIT_DONE)
+        return input_type_names[cause];
+    if (cause > CAUSE_UNKNOWN)
+        cause = CAUSE_UNKNOWN;
+    return cause_names[cause - CAUSE_INIT_DONE];
+}
+void transition_trace_struct::add(const transition_record_struct &record)
+{
+    fold(record.run_time);
+    fold(record.from | (record.to << 8) | (record.cause << 16));
+    uint32_t n = count.load(std::memory_order_relaxed);
+    int slot = n % size;
+    // the slot is invalid while it is written, print() skips it
+    sequences[slot].store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    records[slot] = record;
+    sequences[slot].store(n + 1, std::memory_order_release);
+    // publish the record after it is written
+    count.store(n + 1, std::memory_order_release);
+}
+// only written from the control loop, relaxed is enough
+void transition_trace_struct::fold(uint32_t value)
+{
+    uint32_t hash = digest.load(std::memory_order_relaxed);
+    for (int i = 0; i < 4; i++)
+    {
+        hash ^= (value >> (i * 8)) & 0xff;
+        hash *= 16777619u;
+    }
+    digest.store(hash, std::memory_order_relaxed);
+}
+// count an actuator write and fold it into the digest
+void transition_trace_struct::actuator(uint32_t run_time, input_types actuator, float value)
+{
+    metrics_struct::add(metrics.actuator_writes[actuator]);
+    fold(run_time);
+    fold(actuator | ((uint32_t)lroundf(value * 10) << 8));
+}
+// print the trace as csv, oldest first. Names are decoded, input_bits is hex with bit n = input_types n
+void transition_trace_struct::print(std::string &out)
+{
+    char line[192];
+    out.reserve(size * 96);
+    out += "run_time,duration,from,to,cause,input_bits,tracking_value,stooklijn_target,pendel_target,oat,delta\n";
+    uint32_t end = count.load(std::memory_order_acquire);
+    uint32_t start = end > (uint32_t)size ? end - size : 0;
+    for (uint32_t n = start; n < end; n++)
+    {
+        // the record is plain data, add() may overwrite the slot while it is copied. The sequence of the slot is checked
+        // before and after the copy, a record that was overwritten or is being written is skipped
+        int slot = n % size;
+        if (sequences[slot].load(std::memory_order_acquire) != n + 1)
+            continue;
+        transition_record_struct record = records[slot];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequences[slot].load(std::memory_order_relaxed) != n + 1)
+            continue;
+        snprintf(line, sizeof(line), "%u,%u,%s,%s,%s,0x%04x,%.1f,%.1f,%.1f,%.1f,%.1f\n", (unsigned)record.run_time, (unsigned)record.duration, fsm.state_name((states)record.from), fsm.state_name((states)record.to), cause_name(record.cause), (unsigned)record.input_bits, record.tracking_value, record.stooklijn_target, record.pendel_target, record.oat, record.delta);
+        out += line;
+    }
+}
 state_machine_class::state_machine_class()
 {
-    // initialize the list with inputs
-    input[THERMOSTAT] = new input_struct(&run_time_value);
-    input[THERMOSTAT_SENSOR] = new input_struct(&run_time_value);
-    input[COMPRESSOR] = new input_struct(&run_time_value);
-    input[SWW_RUN] = new input_struct(&run_time_value);
-    input[DEFROST_RUN] = new input_struct(&run_time_value);
-    input[OAT] = new input_struct(&run_time_value);
-    input[STOOKLIJN_TARGET] = new input_struct(&run_time_value);
-    input[TRACKING_VALUE] = new input_struct(&run_time_value);
-    input[BOOST] = new input_struct(&run_time_value);
-    input[BACKUP_HEAT] = new input_struct(&run_time_value);
-    input[EXTERNAL_PUMP] = new input_struct(&run_time_value);
-    input[RELAY_HEAT] = new input_struct(&run_time_value);
-    input[TEMP_NEW_TARGET] = new input_struct(&run_time_value);
-    input[WP_PUMP] = new input_struct(&run_time_value);
-    input[SILENT_MODE] = new input_struct(&run_time_value);
-    input[EMERGENCY] = new input_struct(&run_time_value);
-}
-state_machine_class::~state_machine_class()
-{
-    delete input[THERMOSTAT];
-    delete input[THERMOSTAT_SENSOR];
-    delete input[COMPRESSOR];
-    delete input[SWW_RUN];
-    delete input[DEFROST_RUN];
-    delete input[OAT];
-    delete input[STOOKLIJN_TARGET];
-    delete input[TRACKING_VALUE];
-    delete input[BOOST];
-    delete input[BACKUP_HEAT];
-    delete input[EXTERNAL_PUMP];
-    delete input[RELAY_HEAT];
-    delete input[TEMP_NEW_TARGET];
-    delete input[WP_PUMP];
-    delete input[SILENT_MODE];
-    delete input[EMERGENCY];
+    output_text_buffer.reserve(96);
+    writes[0].actuator = TEMP_NEW_TARGET;
+    writes[1].actuator = SILENT_MODE;
+    // the LG unit sees relay_heat as its thermostat, keep it from short cycling
+    actuators[RELAY_HEAT].min_on_time = 2 * 60;
+    actuators[RELAY_HEAT].min_off_time = 2 * 60;
+    actuators[RELAY_HEAT].max_switches_per_hour = 6;
+    actuators[EXTERNAL_PUMP].min_on_time = 60;
+    actuators[EXTERNAL_PUMP].max_switches_per_hour = 6;
+    actuators[BACKUP_HEAT].min_off_time = 5 * 60;
+    actuators[BACKUP_HEAT].max_switches_per_hour = 6;
+    actuators[SILENT_MODE].min_on_time = 10 * 60;
+    actuators[SILENT_MODE].min_off_time = 10 * 60;
+    actuators[SILENT_MODE].max_switches_per_hour = 4;
+    // backup heat and the target have not changed since boot
+    arm_timer(TIMER_BACKUP_HEAT_GUARD, (15 * 60) + 1);
+    arm_timer(TIMER_TARGET_HOLD, (5 * 60) + 1);
+    // modbus polls every 60s, a sensor is stale after 3 missed polls. buiten_temp publishes every 15 polls (moving average)
+    for (uint32_t &max_age : sensor_max_age)
+        max_age = 3 * 60;
+    sensor_max_age[SENSOR_BUITEN_TEMP] = 2 * 15 * 60;
 }
-void state_machine_class::run_cycle()
+// copy of the complete controller state, run it by restoring it into fsm (run_cycle and the ESPHome components are global)
+// metrics and the transition trace are telemetry and stay outside the snapshot
+state_machine_class state_machine_class::fork() const
+{
+    state_machine_class copy = *this;
+    copy.fork_of = version;
+    return copy;
+}
+void state_machine_class::restore(const state_machine_class &snapshot)
+{
+    *this = snapshot;
+}
+void state_machine_class::control_cycle()
 {
     // do cycle logic in here
     // State machine, main algoritm that runs every 'clock' cycle
@@ -87,21 +748,95 @@ void state_machine_class::run_cycle()
 
     static uint_fast32_t dt = 30; // round(id(state_machine).get_update_interval()/1000); //update interval in seconds
     fsm.increment_run_time(dt);   // increment fsm run_time
+    fsm.advance_timers();         // fire the deadlines reached
+    uint32_t cycle_start = micros();
+    uint32_t cycle_start_ms = millis();
+    uint32_t phase_start = cycle_start;
+    // the whole cycle is charged to the state it started in
+    profile_scope_struct state_profile(metrics.state_cycles[fsm.state()]);
+    uint32_t allocations_start = allocation_count();
+    uint32_t heap_start = free_heap();
+    metrics_struct::add(metrics.state_seconds[fsm.state()], dt);
+    if (fsm.sensors.relay_backup_heat)
+        metrics_struct::add(metrics.backup_heat_seconds, dt);
+    // rebuild the parameter snapshot if a template number changed since the last cycle
+    if (fsm.sensors.config_dirty)
+        fsm.apply_config(fsm.sensors.config);
 
     //***************************************************************
     //*******************INITIALIZE RUN******************************
     //***************************************************************
     // do not run this until INIT is finished
-    if (fsm.state() != INIT)
+    // a failed modbus poll leaves the previous value behind, do not act on it: hold the state and the outputs
+    bool held = fsm.state() != INIT && !fsm.sensors_fresh();
+    if (fsm.state() != INIT && !held)
     {
         // Receive all inputs
         fsm.receive_inputs();
+        phase_start = metrics.lap(PHASE_RECEIVE_INPUTS, phase_start);
         fsm.process_inputs();
+        phase_start = metrics.lap(PHASE_PROCESS_INPUTS, phase_start);
     }
 
+    // a held cycle makes no decisions, the timers, the write queue, the pending actuators and the watchdog still run
+    if (!held)
+        fsm.process_state();
+    phase_start = metrics.lap(PHASE_STATE, phase_start);
+
     //***************************************************************
-    //*******************State Machine States************************
+    //*******************Post Run Cleanup****************************
     //***************************************************************
+    // STABILIZE holds a new target for 5 minutes
+    if (fsm.input[TEMP_NEW_TARGET]->has_flag())
+        fsm.arm_timer(TIMER_TARGET_HOLD, fsm.input[TEMP_NEW_TARGET]->input_change_time + (5 * 60) + 1);
+    // Update modbus target if temp_new_target has changed
+    if (fsm.input[TEMP_NEW_TARGET]->has_flag() && fsm.input[TEMP_NEW_TARGET]->value != (float)fsm.sensors.doel_temp && fsm.state() != INIT)
+    {
+        // prevent update while still in INIT
+        // Queue the new target for modbus
+        fsm.set_target_temp(fsm.input[TEMP_NEW_TARGET]->value);
+    }
+    // Dispatch queued modbus writes and check pending writes against the read back
+    if (fsm.process_write_queue())
+    {
+        // only cycles that write are profiled, otherwise p99 is hidden between empty cycles
+        phase_start = metrics.lap(PHASE_SET_TARGET, phase_start);
+    }
+
+    // Retry switches that were delayed by the actuator dwell
+    fsm.apply_pending_actuators();
+    // Verify the relay interlocks before the cycle ends
+    fsm.check_actuator_invariants();
+    // Now unflag all input values to be able to track changes on next run
+    fsm.unflag_input_values();
+    // Complete state transition that was initiated
+    fsm.handle_state_transition();
+    // Send the sensor values of this cycle to Home Assistant
+    fsm.flush_publishes();
+    fsm.version++;
+    metrics.lap(PHASE_TRANSITION, phase_start);
+    // after INIT the cycle must not touch the heap, months of small allocations fragment it
+    uint32_t allocations = allocation_count() - allocations_start;
+    uint32_t heap_end = free_heap();
+    uint32_t heap_shrink = heap_end < heap_start ? heap_start - heap_end : 0;
+    metrics_struct::add(metrics.cycle_allocations, allocations);
+    metrics_struct::add(metrics.heap_shrink_bytes, heap_shrink);
+    metrics.heap_free.store(heap_end, std::memory_order_relaxed);
+    if ((allocations > 0 || heap_shrink > 0) && fsm.get_prev_state() != NONE)
+    {
+        metrics_struct::add(metrics.allocating_cycles);
+        ESP_LOGW(fsm.state_name(), "run_cycle allocated: %u allocations, free heap %u -> %u", (unsigned)allocations, (unsigned)heap_start, (unsigned)heap_end);
+    }
+    uint32_t cycle_us = micros() - cycle_start;
+    metrics.cycle_time_us.observe(cycle_us);
+    fsm.check_cycle_watchdog(cycle_start_ms, cycle_us);
+}
+//***************************************************************
+//*******************State Machine States************************
+//***************************************************************
+// the decisions of the current state, not called on a cycle that holds on stale sensors
+void state_machine_class::process_state()
+{
     // process state
     switch (fsm.state())
     {
@@ -122,7 +857,7 @@ void state_machine_class::run_cycle()
         fsm.backup_heat(false);
         fsm.boost(false);
         // wait for timeout
-        if (fsm.get_run_time() < 90 || isnan(id(buiten_temp).state) || isnan(id(water_temp_aanvoer).state) || isnan(id(water_temp_retour).state))
+        if (fsm.get_run_time() < 90 || isnan(fsm.sensors.buiten_temp) || isnan(fsm.sensors.water_temp_aanvoer) || isnan(fsm.sensors.water_temp_retour))
             break;
         // after timeout
         fsm.receive_inputs();
@@ -130,13 +865,13 @@ void state_machine_class::run_cycle()
         // the 3 places where thermostat event does not lead to a switch off. Therefore not handled through check_change_events
         if (fsm.input[THERMOSTAT]->state)
         {
-            fsm.state_transition(START);
-            id(controller_info).publish_state("Init complete. First state: START");
+            fsm.state_transition(START, CAUSE_INIT_DONE);
+            fsm.publish_info("Init complete. First state: START");
         }
         else
         {
-            fsm.state_transition(IDLE);
-            id(controller_info).publish_state("Init complete. First state: IDLE");
+            fsm.state_transition(IDLE, CAUSE_INIT_DONE);
+            fsm.publish_info("Init complete. First state: IDLE");
         }
         ESP_LOGD(fsm.state_name(), "INIT Complete first state: %s", fsm.state_name(fsm.get_next_state()));
         break;
@@ -168,7 +903,7 @@ void state_machine_class::run_cycle()
         // the 3 places where thermostat event does not lead to a switch off. Therefore not handled through check_change_events
         if (fsm.input[THERMOSTAT]->state)
         {
-            fsm.state_transition(START);
+            fsm.state_transition(START, CAUSE_THERMOSTAT_ON);
             ESP_LOGD(fsm.state_name(), "THERMOSTAT ON next state: START");
         }
         break;
@@ -184,24 +919,9 @@ void state_machine_class::run_cycle()
         if (!fsm.entry_done)
         {
             fsm.entry_done = true;
-            fsm.external_pump(true); // external pump on
-            fsm.heat(true);          // heat on (to start heatpump)
-            fsm.backup_heat(false);
         }
-        // three minutes delay to allow pump to run and values to stabilise
-        if (fsm.seconds_since_state_start() < (3 * 60))
-            break;
-        // set target, with minimum of tracking value+2 (to ensure compressor start)
-        // but not above stooklijn_target
-        int new_target = fsm.input[STOOKLIJN_TARGET]->value + fsm.get_target_offset();
-        if (new_target < fsm.input[TRACKING_VALUE]->value + 2)
-            new_target = fsm.input[TRACKING_VALUE]->value + 2;
-        if (new_target > fsm.input[STOOKLIJN_TARGET]->value)
-            new_target = fsm.input[STOOKLIJN_TARGET]->value;
-        fsm.set_new_target(new_target);
-        ESP_LOGD(fsm.state_name(), "Run start initial target set; stooklijn_target: %f pendel_target: %f tracking_value: %f ", fsm.input[STOOKLIJN_TARGET]->value, fsm.input[TEMP_NEW_TARGET]->value, fsm.input[TRACKING_VALUE]->value);
-        fsm.set_run_start_time();
-        fsm.state_transition(STARTING);
+        // pump on, wait and set the start target
+        fsm.run_sequence(&state_machine_class::start_sequence);
         // enforce config
         fsm.backup_heat(false);
         break;
@@ -233,7 +953,7 @@ void state_machine_class::run_cycle()
         if (fsm.input[COMPRESSOR]->state)
         {
             // we have ignition
-            fsm.state_transition(STABILIZE);
+            fsm.state_transition(STABILIZE, CAUSE_COMPRESSOR_ON);
         }
         break;
     }
@@ -262,7 +982,7 @@ void state_machine_class::run_cycle()
             break;
 
         // check how far we are in the run
-        if ((fsm.get_run_time() - fsm.get_run_start_time()) > (15 * 60) || ((fsm.get_run_time() - fsm.get_run_start_time()) > (6 * 60) && fsm.compressor_modulation()))
+        if (fsm.timer_expired(TIMER_RUN_SETTLED) || (fsm.timer_expired(TIMER_RUN_MODULATION) && fsm.compressor_modulation()))
         {
             // monitor situation
             // we are stable if derivative => -3 and <= 3 (1 degree in 20 minutes) or if compressor starts modulation (after 6 minutes)
@@ -270,7 +990,7 @@ void state_machine_class::run_cycle()
             {
                 // hand over to run algoritm, run will decide on overshoot/undershoot depending on where we stabilized
                 ESP_LOGD(fsm.state_name(), "Stabilized, RUN is next");
-                fsm.state_transition(RUN);
+                fsm.state_transition(RUN, CAUSE_STABILIZED);
                 break;
             }
         }
@@ -278,11 +998,11 @@ void state_machine_class::run_cycle()
         // update target if tracking_value or stooklijn_target changed. No advanced modulation as this is useless during early run
         // limit number of updates to once every 5 minutes, unless run will be killed
 
-        if (fsm.pendel_delta >= fsm.hysteresis || fsm.input[TEMP_NEW_TARGET]->seconds_since_change() > (5 * 60))
+        if (fsm.pendel_delta >= fsm.hysteresis || fsm.timer_expired(TIMER_TARGET_HOLD))
         {
             if (fsm.delta > 0)
             {
-                fsm.input[TEMP_NEW_TARGET]->receive_value(max(fsm.input[STOOKLIJN_TARGET]->value + fsm.get_target_offset(), fsm.input[TRACKING_VALUE]->value - 4));
+                fsm.input[TEMP_NEW_TARGET]->receive_value(register_temp(max(fsm.input[STOOKLIJN_TARGET]->value + fsm.get_target_offset(), fsm.input[TRACKING_VALUE]->value - 4)));
                 fsm.input[TEMP_NEW_TARGET]->receive_value(min(fsm.input[TEMP_NEW_TARGET]->value, fsm.input[STOOKLIJN_TARGET]->value + fsm.max_overshoot));
             }
         }
@@ -313,7 +1033,7 @@ void state_machine_class::run_cycle()
             break;
 
         // check low TEMP (for backup_heat_always_on)
-        if (fsm.check_low_temp_trigger() && fsm.input[BACKUP_HEAT]->seconds_since_change() > (15 * 60))
+        if (fsm.check_low_temp_trigger() && fsm.timer_expired(TIMER_BACKUP_HEAT_GUARD))
         {
             fsm.backup_heat(true, true);
         }
@@ -325,13 +1045,13 @@ void state_machine_class::run_cycle()
             if (fsm.input[TEMP_NEW_TARGET]->value < fsm.input[STOOKLIJN_TARGET]->value)
             {
                 ESP_LOGD(fsm.state_name(), "Not running on stooklijn_target: new state will be stall");
-                fsm.state_transition(STALL);
+                fsm.state_transition(STALL, CAUSE_BELOW_TARGET);
                 break;
             }
             else
             {
                 ESP_LOGD(fsm.state_name(), "Not running on stooklijn_target: new state will be overshoot");
-                fsm.state_transition(OVERSHOOT);
+                fsm.state_transition(OVERSHOOT, CAUSE_ABOVE_TARGET);
                 break;
             }
         }
@@ -340,21 +1060,21 @@ void state_machine_class::run_cycle()
         // check if overshooting predicted, or if operating > 2 degrees below target (stall)
         // check predicted delta to reach in 20 minutes (pred_20_delta_5 and pred_20_delta_10)
         // then check if we have been in the current state for at least 5 minutes (to prevent over control)
-        if (fsm.seconds_since_state_start() < (5 * 60))
+        if (!fsm.timer_expired(TIMER_STATE_SETTLED))
             break;
         // then check the predicted overshoot
         if (fsm.delta >= 1 && (fsm.pred_20_delta_5 >= 2.5 || fsm.pred_20_delta_10 >= 2.5))
         {
             // start overshooting algoritm to bring temperature back
             ESP_LOGD(fsm.state_name(), "New state will be overshoot. target: %f stooklijn_target: %f delta: %f pred_20_delta_5: %f pred_20_delta_10: %f", fsm.input[TEMP_NEW_TARGET]->value, fsm.input[STOOKLIJN_TARGET]->value, fsm.delta, fsm.pred_20_delta_5, fsm.pred_20_delta_10);
-            fsm.state_transition(OVERSHOOT);
+            fsm.state_transition(OVERSHOOT, CAUSE_PREDICTED_OVERSHOOT);
             break;
         }
         else if (fsm.delta <= -2 || (fsm.delta <= -1 && (fsm.pred_20_delta_5 < -3 || fsm.pred_20_delta_10 < -3)))
         {
             // stall, or stall predicted
             ESP_LOGD(fsm.state_name(), "New state will be stall. target: %f stooklijn_target: %f delta: %f pred_20_delta_5: %f pred_20_delta_10: %f", fsm.input[TEMP_NEW_TARGET]->value, fsm.input[STOOKLIJN_TARGET]->value, fsm.delta, fsm.pred_20_delta_5, fsm.pred_20_delta_10);
-            fsm.state_transition(STALL);
+            fsm.state_transition(STALL, CAUSE_PREDICTED_STALL);
             break;
         } // else status quo
         break;
@@ -391,7 +1111,7 @@ void state_machine_class::run_cycle()
                 // hand back to RUN at target
                 fsm.input[TEMP_NEW_TARGET]->receive_value(fsm.input[STOOKLIJN_TARGET]->value);
                 ESP_LOGD(fsm.state_name(), "stooklijn_target <= pendel_target, delta < 2, no overshoot predicted, my job is done.");
-                fsm.state_transition(RUN);
+                fsm.state_transition(RUN, CAUSE_OVERSHOOT_CONTAINED);
                 break;
             }
         }
@@ -443,10 +1163,13 @@ void state_machine_class::run_cycle()
             break;
 
         // check low temp (for backup_heat_always_on)
-        if (fsm.check_low_temp_trigger() && fsm.input[BACKUP_HEAT]->seconds_since_change() > (15 * 60))
+        if (fsm.check_low_temp_trigger() && fsm.timer_expired(TIMER_BACKUP_HEAT_GUARD))
         {
             fsm.backup_heat(true, true);
         }
+        // size the backup heat to the deficit predicted for the next 30 minutes, every cycle
+        if (fsm.backup_duty_cycle)
+            fsm.backup_heat_duty_cycle(-(fsm.delta + (fsm.derivative_D_5 * 30)));
 
         // 1: check if recovered
         if (fsm.input[TEMP_NEW_TARGET]->value >= fsm.input[STOOKLIJN_TARGET]->value && fsm.delta >= 0 && fsm.pred_20_delta_5 >= 0 && fsm.pred_20_delta_10 >= 0)
@@ -455,7 +1178,7 @@ void state_machine_class::run_cycle()
             // return to target and call run
             fsm.input[TEMP_NEW_TARGET]->receive_value(fsm.input[STOOKLIJN_TARGET]->value);
             ESP_LOGD(fsm.state_name(), "delta > 0, stooklijn_target >= pendel_target, my job is done.");
-            fsm.state_transition(RUN);
+            fsm.state_transition(RUN, CAUSE_STALL_RECOVERED);
             break;
         }
 
@@ -467,54 +1190,8 @@ void state_machine_class::run_cycle()
             break;
         }
 
-        // otherwise always at least 10 minutes waiting time
-        if (fsm.input[TEMP_NEW_TARGET]->seconds_since_change() < (10 * 60))
-        {
-            ESP_LOGD(fsm.state_name(), "Stall is waiting for effect of previous target change");
-            break;
-        }
-
-        // 3: check if operating below stooklijn_target and fix it
-        if (fsm.input[TEMP_NEW_TARGET]->value < fsm.input[STOOKLIJN_TARGET]->value)
-        {
-            // is it bad?
-            if ((fsm.delta + (fsm.derivative_D_5 * 30)) < 0)
-            {
-                // it will not be fixed next 30 minutes, take a big step
-                // current target + 3 or tracking value, whichever is higher
-                fsm.input[TEMP_NEW_TARGET]->receive_value(max(fsm.input[TRACKING_VALUE]->value, fsm.input[TEMP_NEW_TARGET]->value + 3));
-            }
-            else
-            {
-                // current target + 1 or tracking value, whichever is higher
-                fsm.input[TEMP_NEW_TARGET]->receive_value(max(fsm.input[TRACKING_VALUE]->value, fsm.input[TEMP_NEW_TARGET]->value + 1));
-            }
-            // but not above stooklijn_target (yet)
-            fsm.input[TEMP_NEW_TARGET]->receive_value(min(fsm.input[STOOKLIJN_TARGET]->value, fsm.input[TEMP_NEW_TARGET]->value));
-            ESP_LOGD(fsm.state_name(), "Operating below target, raising target, pendel_target: %f", fsm.input[TEMP_NEW_TARGET]->value);
-            break;
-        }
-        // 4: We are operating at target, are we modulating?
-        if (fsm.compressor_modulation() && fsm.input[TEMP_NEW_TARGET]->value < fsm.input[STOOKLIJN_TARGET]->value + 3)
-        {
-            // raise target above stooklijn target to stop modulation
-            fsm.input[TEMP_NEW_TARGET]->receive_value(min(fsm.input[STOOKLIJN_TARGET]->value + 3, fsm.input[TRACKING_VALUE]->value + 3));
-            ESP_LOGD(fsm.state_name(), "Modulating, raising target, pendel_target: %f", fsm.input[TEMP_NEW_TARGET]->value);
-            break;
-        }
-        // 5 We are above target and with no modulation, so those tricks are gone. How bad is it?
-        if ((fsm.delta + (fsm.derivative_D_5 * 30)) < 0)
-        {
-            // it will still not be fixed next 30 minutes
-            if (fsm.input[OAT]->value < id(backup_heater_active_temp).state && !id(relay_backup_heat).state)
-            {
-                id(relay_backup_heat).turn_on();
-                ESP_LOGD(fsm.state_name(), "tracking_value stalled, switched backup_heater on");
-            }
-            break;
-        }
-        // Waiting for delta te become within range
-        ESP_LOGD(fsm.state_name(), "Stall is waiting for next action (or out of options).");
+        // 3-5: after each target change wait for its effect, then take the next step
+        fsm.run_sequence(&state_machine_class::stall_sequence);
         break;
     }
     case WAIT:
@@ -545,14 +1222,8 @@ void state_machine_class::run_cycle()
             fsm.input[TEMP_NEW_TARGET]->receive_value(fsm.input[STOOKLIJN_TARGET]->value);
             ESP_LOGD(fsm.state_name(), "Target changed: Setting new target: %f", fsm.input[TEMP_NEW_TARGET]->value);
         }
-        // wait at least 6 minutes before switching to run, even if compressor is running
-        if (fsm.seconds_since_state_start() < (6 * 60))
-            break;
-        if (fsm.input[COMPRESSOR]->state)
-        {
-            fsm.state_transition(RUN);
-            break;
-        }
+        // wait for the compressor, then RUN
+        fsm.run_sequence(&state_machine_class::wait_sequence);
         break;
     }
     case SWW:
@@ -566,12 +1237,12 @@ void state_machine_class::run_cycle()
         if (!fsm.entry_done)
         {
             fsm.entry_done = true;
-            if (fsm.input[THERMOSTAT]->state && fsm.input[OAT]->value <= id(backup_heater_active_temp).state)
+            if (fsm.input[THERMOSTAT]->state && fsm.input[OAT]->value <= fsm.config.backup_heater_active_temp)
             {
                 fsm.backup_heat(true);
             }
             else
-                id(controller_info).publish_state("Starting SWW with no backup heat.");
+                fsm.publish_info("Starting SWW with no backup heat.");
         }
         // enforce allowed config
         fsm.start_events();
@@ -583,10 +1254,10 @@ void state_machine_class::run_cycle()
             break;
         if (fsm.input[THERMOSTAT]->has_flag() && fsm.input[THERMOSTAT]->state)
         {
-            if (fsm.input[OAT]->value <= id(backup_heater_active_temp).state)
+            if (fsm.input[OAT]->value <= fsm.config.backup_heater_active_temp)
             {
                 fsm.backup_heat(true);
-                id(controller_info).publish_state("SWW thermostat on: backup heat on");
+                fsm.publish_info("SWW thermostat on: backup heat on");
             }
         }
         if (!fsm.input[SWW_RUN]->state)
@@ -595,21 +1266,21 @@ void state_machine_class::run_cycle()
             if (!fsm.input[THERMOSTAT_SENSOR]->state)
             {
                 // straight off if no thermostat signal after SWW (ignore delay)
-                fsm.state_transition(AFTERRUN);
+                fsm.state_transition(AFTERRUN, CAUSE_SWW_DONE);
                 break;
             }
             else
             {
                 if (fsm.input[COMPRESSOR]->state)
-                    fsm.state_transition(RUN);
+                    fsm.state_transition(RUN, CAUSE_SWW_DONE);
                 else
-                    fsm.state_transition(WAIT);
+                    fsm.state_transition(WAIT, CAUSE_SWW_DONE);
                 // start boost if we were running without backup heat
                 if (!fsm.input[BACKUP_HEAT]->state)
                 {
-                    if (fsm.input[OAT]->value > id(backup_heater_active_temp).state)
+                    if (fsm.input[OAT]->value > fsm.config.backup_heater_active_temp)
                         fsm.boost(true);
-                    id(controller_info).publish_state("SWW done starting boost.");
+                    fsm.publish_info("SWW done starting boost.");
                     fsm.boost(true);
                 }
                 fsm.input[TEMP_NEW_TARGET]->receive_value(fsm.input[STOOKLIJN_TARGET]->value);
@@ -629,12 +1300,13 @@ void state_machine_class::run_cycle()
         if (!fsm.entry_done)
         {
             fsm.entry_done = true;
-            if (fsm.input[THERMOSTAT]->state && fsm.input[OAT]->value <= id(backup_heater_active_temp).state)
+            // no backup heat needed if the preheat banked enough heat in the loop
+            if (fsm.input[THERMOSTAT]->state && fsm.input[OAT]->value <= fsm.config.backup_heater_active_temp && !fsm.defrost_heat_banked)
             {
                 fsm.backup_heat(true);
             }
             else
-                id(controller_info).publish_state("DEFROST with backup heat off.");
+                fsm.publish_info("DEFROST with backup heat off.");
         }
         // enforce allowed config
         fsm.start_events();
@@ -649,33 +1321,9 @@ void state_machine_class::run_cycle()
             // defrosting stopped initially start with stooklijn_target as target
             if (fsm.input[TEMP_NEW_TARGET]->value != fsm.input[STOOKLIJN_TARGET]->value)
                 fsm.input[TEMP_NEW_TARGET]->receive_value(fsm.input[STOOKLIJN_TARGET]->value);
-            // 10 minute delay (defrost takes 4 minutes) some additional delay to allow values to stabilize and backup heater to run
-            if (fsm.seconds_since_state_start() < (10 * 60))
-                break;
-            if (!fsm.input[THERMOSTAT_SENSOR]->state)
-            {
-                // straight off if no thermostat signal after SWW (ignore delay)
-                fsm.state_transition(AFTERRUN);
-                break;
-            }
-            if (fsm.input[COMPRESSOR]->state)
-            {
-                if (fsm.delta > 0)
-                {
-                    fsm.backup_heat(false);
-                    fsm.state_transition(RUN);
-                }
-                else
-                {
-                    fsm.state_transition(STALL);
-                }
-            }
-            else
-            {
-                fsm.backup_heat(false);
-                fsm.state_transition(WAIT);
-            }
         }
+        // wait for the end of the defrost and the recovery, then decide on the next state
+        fsm.run_sequence(&state_machine_class::defrost_sequence);
         break;
     }
     case AFTERRUN:
@@ -701,46 +1349,74 @@ void state_machine_class::run_cycle()
         // the 3 places where thermostat event does not lead to a switch off. Therefore not handled through check_change_events
         if (fsm.input[THERMOSTAT]->state)
         {
-            fsm.state_transition(START);
+            fsm.state_transition(START, CAUSE_THERMOSTAT_ON);
             ESP_LOGD(fsm.state_name(), "THERMOSTAT ON next state: START");
         }
-        // Timeout
-        if (fsm.seconds_since_state_start() < (id(external_pump_runover).state * 60))
-            break;
-        fsm.state_transition(IDLE);
+        // pump runover, then IDLE
+        fsm.run_sequence(&state_machine_class::afterrun_sequence);
         break;
     }
     case NONE:
     {
         ESP_LOGE(fsm.state_name(), "ERROR: State is none");
-        id(controller_info).publish_state("ERROR: state = NONE");
+        fsm.publish_info("ERROR: state = NONE");
     }
     }
 
     if (fsm.get_run_time() % fsm.alive_timer == 0)
     {
-        ESP_LOGD(fsm.state_name(), "**alive** timer: %d oat: %f inlet: %f outlet: %f tracking_value: %f stooklijn: %f pendel: %f delta: %f pendel_delta: %f ", fsm.get_run_time(), fsm.input[OAT]->value, id(water_temp_retour).state, id(water_temp_aanvoer).state, fsm.input[TRACKING_VALUE]->value, fsm.input[STOOKLIJN_TARGET]->value, fsm.input[TEMP_NEW_TARGET]->value, fsm.delta, fsm.pendel_delta);
-    }
-
-    //***************************************************************
-    //*******************Post Run Cleanup****************************
-    //***************************************************************
-    // Update modbus target if temp_new_target has changed
-    if (fsm.input[TEMP_NEW_TARGET]->has_flag() && fsm.input[TEMP_NEW_TARGET]->value != (float)id(doel_temp).state && fsm.state() != INIT)
-    {
-        // prevent update while still in INIT
-        // Update target through modbus
-        fsm.set_target_temp(fsm.input[TEMP_NEW_TARGET]->value);
+        ESP_LOGD(fsm.state_name(), "**alive** timer: %u oat: %f inlet: %f outlet: %f tracking_value: %f stooklijn: %f pendel: %f delta: %f pendel_delta: %f ", (unsigned)fsm.get_run_time(), fsm.input[OAT]->value, fsm.sensors.water_temp_retour, fsm.sensors.water_temp_aanvoer, fsm.input[TRACKING_VALUE]->value, fsm.input[STOOKLIJN_TARGET]->value, fsm.input[TEMP_NEW_TARGET]->value, fsm.delta, fsm.pendel_delta);
     }
-
-    // Now unflag all input values to be able to track changes on next run
-    fsm.unflag_input_values();
-    // Complete state transition that was initiated
-    fsm.handle_state_transition();
 }
+// called from on_value of buiten_temp, on the ESPHome loop. The request travels to the control cycle with the snapshot
 void state_machine_class::update_stooklijn()
 {
+    stooklijn_dirty = true;
+}
+// called from set_action of the template numbers. The number state is published after the action, so only mark it here
+void state_machine_class::update_config()
+{
+    config_dirty = true;
+}
+// read the template numbers, on the ESPHome loop
+void state_machine_class::load_config(config_struct &new_config)
+{
+    new_config.stooklijn_min_oat = id(stooklijn_min_oat).state;
+    new_config.stooklijn_max_oat = id(stooklijn_max_oat).state;
+    new_config.stooklijn_max_wtemp = id(stooklijn_max_wtemp).state;
+    new_config.stooklijn_min_wtemp = id(stooklijn_min_wtemp).state;
+    new_config.wp_stooklijn_offset = id(wp_stooklijn_offset).state;
+    new_config.stooklijn_curve = id(stooklijn_curve).state;
+    new_config.minimum_run_time = id(minimum_run_time).state;
+    new_config.external_pump_runover = id(external_pump_runover).state;
+    new_config.oat_silent_always_off = id(oat_silent_always_off).state;
+    new_config.oat_silent_always_on = id(oat_silent_always_on).state;
+    new_config.backup_heater_always_on_temp = id(backup_heater_always_on_temp).state;
+    new_config.backup_heater_active_temp = id(backup_heater_active_temp).state;
+    new_config.thermostat_off_delay = id(thermostat_off_delay).state;
+    new_config.thermostat_on_delay = id(thermostat_on_delay).state;
+    new_config.boost_time = id(boost_time).state;
+    new_config.room_temp_target = id(room_temp_target).state;
+}
+// apply a complete configuration at once (also used to inject a configuration without template numbers)
+void state_machine_class::set_config(const config_struct &new_config)
+{
+    config_dirty = false;
+    apply_config(new_config);
+}
+// config_dirty belongs to the ESPHome loop, the control cycle applies the config captured with the sensors
+void state_machine_class::apply_config(const config_struct &new_config)
+{
+    config = new_config;
+    if (!config.validate())
+    {
+        ESP_LOGW(state_name(), "Invalid configuration, invalid values replaced by defaults");
+        publish_info("Invalid configuration corrected");
+    }
+    // stooklijn parameters may have changed
     update_stooklijn_bool = true;
+    // and the delays of the running deadlines
+    rearm_timers();
 }
 states state_machine_class::state()
 {
@@ -754,10 +1430,11 @@ states state_machine_class::get_next_state()
 {
     return next_state;
 }
-void state_machine_class::state_transition(states newstate)
+void state_machine_class::state_transition(states newstate, uint8_t cause)
 {
     next_state = newstate;
-    ESP_LOGD(state_name(), "State transition-> %s", state_name(get_next_state()));
+    next_state_cause = cause;
+    ESP_LOGD(state_name(), "State transition-> %s cause: %s", state_name(get_next_state()), cause_name(cause));
 }
 void state_machine_class::handle_state_transition()
 {
@@ -765,37 +1442,68 @@ void state_machine_class::handle_state_transition()
     {
         prev_state = current_state;
         current_state = get_next_state();
+        metrics_struct::add(metrics.transitions[prev_state][current_state]);
+        // record the transition with its cause and the inputs it was based on
+        transition_record_struct record;
+        record.run_time = get_run_time();
+        record.duration = seconds_since_state_start();
+        record.from = prev_state;
+        record.to = current_state;
+        record.cause = next_state_cause;
+        record.input_bits = 0;
+        for (int i = THERMOSTAT; i <= EMERGENCY; i++)
+        {
+            if (input[i]->state)
+                record.input_bits |= (1 << i);
+        }
+        record.tracking_value = input[TRACKING_VALUE]->value;
+        record.stooklijn_target = input[STOOKLIJN_TARGET]->value;
+        record.pendel_target = input[TEMP_NEW_TARGET]->value;
+        record.oat = input[OAT]->value;
+        record.delta = delta;
+        transition_trace.add(record);
         state_start_time = get_run_time();
+        arm_timer(TIMER_STATE_SETTLED, state_start_time + (5 * 60));
         entry_done = false;
-        id(controller_state).publish_state(state_name());
-        ESP_LOGD(state_name(), "State transition complete-> %s", state_name());
-    }
-}
+        release_sequences(prev_state);
+        // the duty cycle only runs in STALL, the next state decides on backup heat itself
+        if (backup_duty_active && prev_state == STALL)
+        {
+            backup_duty_active = false;
+            backup_heat(false);
+        }
+        output_text(OUTPUT_CONTROLLER_STATE, state_name());
+        ESP_LOGD(state_name(), "State transition complete-> %s cause: %s", state_name(), cause_name(next_state_cause));
+    }
+}
 const char *state_machine_class::state_friendly_name(states stt)
 {
     if (stt == NONE)
         stt = current_state;
-    static const std::string state_string_friendly_list[13] = {"None", "Initialiseren", "Uit", "Start", "Opstarten", "Aan (stabiliseren)", "Aan (verwarmen)", "Aan (overshoot)", "Aan (stall)", "Pauze (Uit)", "Aan (Warm Water)", "Ontdooien", "Nadraaien"};
-    return state_string_friendly_list[stt].c_str();
+    static const char *const state_string_friendly_list[13] = {"None", "Initialiseren", "Uit", "Start", "Opstarten", "Aan (stabiliseren)", "Aan (verwarmen)", "Aan (overshoot)", "Aan (stall)", "Pauze (Uit)", "Aan (Warm Water)", "Ontdooien", "Nadraaien"};
+    return state_string_friendly_list[stt];
 }
 const char *state_machine_class::state_name(states stt)
 {
     if (stt == NONE)
         stt = current_state;
-    static const std::string state_string_list[13] = {"NONE", "INIT", "IDLE", "START", "STARTING", "STABILIZE", "RUN", "OVERSHOOT", "STALL", "WAIT", "SWW", "DEFROST", "AFTERRUN"};
-    return state_string_list[stt].c_str();
+    static const char *const state_string_list[13] = {"NONE", "INIT", "IDLE", "START", "STARTING", "STABILIZE", "RUN", "OVERSHOOT", "STALL", "WAIT", "SWW", "DEFROST", "AFTERRUN"};
+    return state_string_list[stt];
 }
 uint_fast32_t state_machine_class::get_run_time()
 {
-    return run_time_value;
+    return input.run_time;
 }
 void state_machine_class::increment_run_time(uint_fast32_t increment)
 {
-    run_time_value += increment;
+    input.run_time += increment;
 }
 void state_machine_class::set_run_start_time()
 {
     run_start_time = get_run_time();
+    arm_timer(TIMER_MINIMUM_RUN, run_start_time + (uint_fast32_t)(config.minimum_run_time * 60) + 1);
+    arm_timer(TIMER_RUN_MODULATION, run_start_time + (6 * 60) + 1);
+    arm_timer(TIMER_RUN_SETTLED, run_start_time + (15 * 60) + 1);
 }
 uint_fast32_t state_machine_class::get_run_start_time()
 {
@@ -809,52 +1517,105 @@ uint_fast32_t state_machine_class::seconds_since_state_start()
 {
     return get_run_time() - get_state_start_time();
 }
+// compressor, defrost and supply temperature decide the transitions, refuse the cycle when one of them is stale
+bool state_machine_class::sensors_fresh()
+{
+    bool fresh = true;
+    for (snapshot_sensors sensor : {SENSOR_COMPRESSOR_RUNNING, SENSOR_DEFROSTING, SENSOR_WATER_TEMP_AANVOER})
+    {
+        if (sensors.valid[sensor])
+            continue;
+        fresh = false;
+        metrics_struct::add(metrics.stale_refusals[sensor]);
+        if (!holding_stale)
+            ESP_LOGW(state_name(), "%s stale: %u s since the last update", sensor_names[sensor], (unsigned)((sensors.captured_ms - sensors.updated_ms[sensor]) / 1000));
+    }
+    if (!fresh)
+    {
+        metrics_struct::add(metrics.stale_cycles);
+        publish_info("Sensor data stale, state and outputs held");
+    }
+    else if (holding_stale)
+    {
+        ESP_LOGD(state_name(), "sensor data fresh again");
+        publish_info("Sensor data fresh again");
+    }
+    holding_stale = !fresh;
+    return fresh;
+}
 // receive all values, booleans (states) or floats (values)
 void state_machine_class::receive_inputs()
 {
-    input[THERMOSTAT_SENSOR]->receive_state(id(thermostat_signal).state); // state of thermostat input
+    profile_scope_struct profile(metrics.functions[PROFILE_RECEIVE_INPUTS]);
+    if (zone_count > 0)
+        input[THERMOSTAT_SENSOR]->receive_state(update_zones()); // combined demand of the zones
+    else
+        input[THERMOSTAT_SENSOR]->receive_state(sensors.thermostat_signal); // state of thermostat input
     input[THERMOSTAT]->receive_state(thermostat_state());
-    input[COMPRESSOR]->receive_state(id(compressor_running).state); // is the compressor running
-    input[SWW_RUN]->receive_state(id(sww_heating).state);           // is the domestic hot water run active
-    input[DEFROST_RUN]->receive_state(id(defrosting).state);        // is defrost active
-    input[OAT]->receive_value(round(id(buiten_temp).state));        // outside air temperature
+    input[COMPRESSOR]->receive_state(sensors.compressor_running); // is the compressor running
+    input[SWW_RUN]->receive_state(sensors.sww_heating);           // is the domestic hot water run active
+    input[DEFROST_RUN]->receive_state(sensors.defrosting);        // is defrost active
+    // full resolution, only the modbus target (holding register 2) is whole degrees
+    input[OAT]->receive_value(oat_filter.update(sensors.buiten_temp, sensors.updated_ms[SENSOR_BUITEN_TEMP])); // outside air temperature
+    if (oat_filter.rejected)
+        metrics_struct::add(metrics.signal_outliers[OAT]);
+    if (isnan(sensors.buiten_temp) || isnan(sensors.water_temp_aanvoer))
+        metrics_struct::add(metrics.modbus_read_errors);
+    if (sensors.stooklijn_dirty)
+        update_stooklijn_bool = true;
     if (input[OAT]->has_flag() || update_stooklijn_bool)
         input[STOOKLIJN_TARGET]->receive_value(calculate_stooklijn()); // stooklijn target
     // Set to value that anti-pendel script will track (outlet/inlet) (recommend inlet)
-    input[TRACKING_VALUE]->receive_value(floor(id(water_temp_aanvoer).state));
-    input[BOOST]->receive_state(id(boost_switch).state);
-    input[BACKUP_HEAT]->receive_state(id(relay_backup_heat).state); // is backup heat on/off
-    input[EXTERNAL_PUMP]->receive_state(id(relay_pump).state);      // is external pump on/off
-    input[RELAY_HEAT]->receive_state(id(relay_heat).state);         // is realy_heat (heatpump external thermostat contact) on/off
-    input[WP_PUMP]->receive_state(id(pump_running).state);          // is internal pump running
-    input[SILENT_MODE]->receive_state(id(silent_mode_state).state); // is silent mode on
+    input[TRACKING_VALUE]->receive_value(tracking_filter.update(sensors.water_temp_aanvoer, sensors.updated_ms[SENSOR_WATER_TEMP_AANVOER]));
+    if (tracking_filter.rejected)
+        metrics_struct::add(metrics.signal_outliers[TRACKING_VALUE]);
+    input[BOOST]->receive_state(sensors.boost_switch);
+    input[BACKUP_HEAT]->receive_state(sensors.relay_backup_heat); // is backup heat on/off
+    input[EXTERNAL_PUMP]->receive_state(sensors.relay_pump);      // is external pump on/off
+    input[RELAY_HEAT]->receive_state(sensors.relay_heat);         // is realy_heat (heatpump external thermostat contact) on/off
+    input[WP_PUMP]->receive_state(sensors.pump_running);          // is internal pump running
+    input[SILENT_MODE]->receive_state(sensors.silent_mode_state); // is silent mode on
     if (input[TEMP_NEW_TARGET]->value == 0.0)
         input[TEMP_NEW_TARGET]->value = input[STOOKLIJN_TARGET]->value; // set temp new target
+#ifdef LG_FIXED_POINT_CONTROL
+    delta = from_q16(to_q16(input[TRACKING_VALUE]->value) - to_q16(input[STOOKLIJN_TARGET]->value));
+    pendel_delta = from_q16(to_q16(input[TRACKING_VALUE]->value) - to_q16(input[TEMP_NEW_TARGET]->value));
+#else
     delta = input[TRACKING_VALUE]->value - input[STOOKLIJN_TARGET]->value;
     pendel_delta = input[TRACKING_VALUE]->value - input[TEMP_NEW_TARGET]->value;
+#endif // LG_FIXED_POINT_CONTROL
 }
 void state_machine_class::process_inputs()
 {
-    if (input[BOOST]->state)
+    if (input[BACKUP_HEAT]->has_flag())
+        arm_timer(TIMER_BACKUP_HEAT_GUARD, input[BACKUP_HEAT]->input_change_time + (15 * 60) + 1);
+    if (input[BOOST]->has_flag())
     {
-        if (input[BOOST]->seconds_since_change() > (id(boost_time).state * 60))
-            boost(false);
+        if (input[BOOST]->state)
+            arm_timer(TIMER_BOOST, input[BOOST]->input_change_time + (uint_fast32_t)(config.boost_time * 60) + 1);
+        else
+            cancel_timer(TIMER_BOOST);
     }
+    if (input[BOOST]->state && timer_expired(TIMER_BOOST))
+        boost(false);
     if (input[BOOST]->has_flag())
     {
         toggle_boost();
     }
+    update_defrost_prediction();
+    update_room_compensation(30);
+    update_building_model();
     toggle_silent_mode();
     if (input[WP_PUMP]->state && state() != SWW && state() != DEFROST)
     {
         // calculate derivative and publish new value
         calculate_derivative(input[TRACKING_VALUE]->value);
     }
-    else if (!input[WP_PUMP]->state && derivative.size() > 0)
+    else if (!input[WP_PUMP]->state && derivative.count > 0)
     {
         // if pump not running and derivative has values clear it
         derivative.clear();
-        id(derivative_value).publish_state(0);
+        output(OUTPUT_DERIVATIVE_VALUE, 0);
     }
 }
 // set input.value.prev_value = input_value.value to remove the implicit 'value changed' flag
@@ -878,14 +1639,313 @@ void state_machine_class::unflag_input_values()
     input[EMERGENCY]->unflag();
 }
 //***************************************************************
+//*******************Timed sequences*****************************
+//***************************************************************
+// Stackless continuations for the timed parts of the states (no C++20 coroutines in the ESP32 toolchain). Every await
+// stores its line as resume point and returns, on the next resume the switch jumps back to it. The await falls through
+// into its own case label, hence the [[fallthrough]].
+// Locals do not survive an await: the function returns at every await and the switch jumps past their initialisation
+// on resume. Anything needed after an await lives in a member (delta, defrost_heat_banked, ...) or an input, a local is
+// only allowed in a block that holds no await (like new_target in start_sequence). One await per line, and no switch
+// statements around an await
+#define SEQUENCE_BEGIN(frame)      \
+    switch ((frame).resume_point) \
+    {                              \
+    case 0:
+#define SEQUENCE_SUSPEND(frame)             \
+    (frame).resume_point = __LINE__;        \
+    [[fallthrough]];                        \
+    case __LINE__:                          \
+        if (!sequence_ready(frame))         \
+            return SEQUENCE_WAITING;
+// resume at run_time until (a time in the past continues immediately)
+#define SEQUENCE_AWAIT_UNTIL(frame, until) \
+    do                                     \
+    {                                      \
+        (frame).wait(until);               \
+        SEQUENCE_SUSPEND(frame)            \
+    } while (0)
+#define SEQUENCE_AWAIT_DELAY(frame, seconds) SEQUENCE_AWAIT_UNTIL(frame, get_run_time() + (seconds))
+// resume on the next cycle
+#define SEQUENCE_YIELD(frame) SEQUENCE_AWAIT_UNTIL(frame, get_run_time() + 1)
+// resume when input has the given state, or at until
+#define SEQUENCE_AWAIT_INPUT(frame, input, state, until) \
+    do                                                   \
+    {                                                    \
+        (frame).wait(until, input, state);               \
+        SEQUENCE_SUSPEND(frame)                          \
+    } while (0)
+// resume when condition is true, or at until. The only await that is entered every cycle
+#define SEQUENCE_AWAIT(frame, condition, until)              \
+    do                                                       \
+    {                                                        \
+        (frame).wait(until, -1, false, true);                \
+        (frame).resume_point = __LINE__;                     \
+        [[fallthrough]];                                     \
+    case __LINE__:                                           \
+        if (!(condition) && !sequence_ready(frame))          \
+            return SEQUENCE_WAITING;                         \
+    } while (0)
+#define SEQUENCE_END(frame)      \
+    }                            \
+    (frame).resume_point = 0;    \
+    return SEQUENCE_DONE;
+static const uint_fast32_t sequence_forever = UINT32_MAX; // no deadline, wait for the input only
+
+void sequence_frame_struct::wait(uint_fast32_t until, int8_t input, bool state, bool poll_condition)
+{
+    deadline = until;
+    wait_input = input;
+    wait_state = state;
+    poll = poll_condition;
+}
+// resume the sequence of the current state, a suspended sequence is only entered when its deadline or input is reached
+sequence_results state_machine_class::run_sequence(sequence_function function)
+{
+    sequence_frame_struct *frame = nullptr;
+    sequence_frame_struct *free_frame = nullptr;
+    for (sequence_frame_struct &candidate : sequences)
+    {
+        if (candidate.active && candidate.owner == current_state && candidate.function == function)
+        {
+            frame = &candidate;
+            break;
+        }
+        if (!candidate.active && free_frame == nullptr)
+            free_frame = &candidate;
+    }
+    if (frame == nullptr)
+    {
+        if (free_frame == nullptr)
+        {
+            metrics_struct::add(metrics.sequence_pool_exhausted);
+            ESP_LOGE(state_name(), "No free sequence frame, sequence not started");
+            return SEQUENCE_WAITING;
+        }
+        frame = free_frame;
+        *frame = sequence_frame_struct();
+        frame->active = true;
+        frame->owner = current_state;
+        frame->function = function;
+    }
+    else if (!frame->poll && !sequence_ready(*frame))
+        return SEQUENCE_WAITING;
+    metrics_struct::add(metrics.sequence_resumes);
+    sequence_results result = (this->*function)(*frame);
+    if (result == SEQUENCE_DONE)
+        frame->active = false;
+    return result;
+}
+bool state_machine_class::sequence_ready(const sequence_frame_struct &frame)
+{
+    if (get_run_time() >= frame.deadline)
+        return true;
+    return frame.wait_input >= 0 && input[frame.wait_input]->state == frame.wait_state;
+}
+// a sequence does not outlive its state, the next entry starts it from the beginning
+void state_machine_class::release_sequences(states owner)
+{
+    for (sequence_frame_struct &frame : sequences)
+    {
+        if (frame.owner == owner)
+            frame.active = false;
+    }
+}
+sequence_results state_machine_class::start_sequence(sequence_frame_struct &frame)
+{
+    SEQUENCE_BEGIN(frame);
+    external_pump(true); // external pump on
+    heat(true);          // heat on (to start heatpump)
+    backup_heat(false);
+    // three minutes delay to allow pump to run and values to stabilise
+    SEQUENCE_AWAIT_UNTIL(frame, state_start_time + (3 * 60));
+    {
+        // set target, with minimum of tracking value+2 (to ensure compressor start)
+        // but not above stooklijn_target
+        int new_target = input[STOOKLIJN_TARGET]->value + get_target_offset();
+        if (new_target < input[TRACKING_VALUE]->value + 2)
+            new_target = register_temp(input[TRACKING_VALUE]->value + 2);
+        if (new_target > input[STOOKLIJN_TARGET]->value)
+            new_target = input[STOOKLIJN_TARGET]->value;
+        set_new_target(new_target);
+    }
+    ESP_LOGD(state_name(), "Run start initial target set; stooklijn_target: %f pendel_target: %f tracking_value: %f ", input[STOOKLIJN_TARGET]->value, input[TEMP_NEW_TARGET]->value, input[TRACKING_VALUE]->value);
+    set_run_start_time();
+    state_transition(STARTING, CAUSE_START_DONE);
+    SEQUENCE_END(frame);
+}
+sequence_results state_machine_class::wait_sequence(sequence_frame_struct &frame)
+{
+    SEQUENCE_BEGIN(frame);
+    // wait at least 6 minutes before switching to run, even if compressor is running
+    SEQUENCE_AWAIT_UNTIL(frame, state_start_time + (6 * 60));
+    SEQUENCE_AWAIT_INPUT(frame, COMPRESSOR, true, sequence_forever);
+    state_transition(RUN, CAUSE_COMPRESSOR_ON);
+    SEQUENCE_END(frame);
+}
+sequence_results state_machine_class::stall_sequence(sequence_frame_struct &frame)
+{
+    SEQUENCE_BEGIN(frame);
+    for (;;)
+    {
+        // always at least 10 minutes waiting time after a target change, a new change moves the deadline
+        while (input[TEMP_NEW_TARGET]->seconds_since_change() < (10 * 60))
+        {
+            ESP_LOGD(state_name(), "Stall is waiting for effect of previous target change");
+            SEQUENCE_AWAIT_UNTIL(frame, input[TEMP_NEW_TARGET]->input_change_time + (10 * 60));
+        }
+        if (input[TEMP_NEW_TARGET]->value < input[STOOKLIJN_TARGET]->value)
+        {
+            // 3: operating below stooklijn_target, fix it
+            // is it bad?
+            if ((delta + (derivative_D_5 * 30)) < 0)
+            {
+                // it will not be fixed next 30 minutes, take a big step
+                // current target + 3 or tracking value, whichever is higher
+                input[TEMP_NEW_TARGET]->receive_value(register_temp(max(input[TRACKING_VALUE]->value, input[TEMP_NEW_TARGET]->value + 3)));
+            }
+            else
+            {
+                // current target + 1 or tracking value, whichever is higher
+                input[TEMP_NEW_TARGET]->receive_value(register_temp(max(input[TRACKING_VALUE]->value, input[TEMP_NEW_TARGET]->value + 1)));
+            }
+            // but not above stooklijn_target (yet)
+            input[TEMP_NEW_TARGET]->receive_value(min(input[STOOKLIJN_TARGET]->value, input[TEMP_NEW_TARGET]->value));
+            ESP_LOGD(state_name(), "Operating below target, raising target, pendel_target: %f", input[TEMP_NEW_TARGET]->value);
+        }
+        else if (compressor_modulation() && input[TEMP_NEW_TARGET]->value < input[STOOKLIJN_TARGET]->value + 3)
+        {
+            // 4: operating at target but modulating, raise target above stooklijn target to stop modulation
+            input[TEMP_NEW_TARGET]->receive_value(register_temp(min(input[STOOKLIJN_TARGET]->value + 3, input[TRACKING_VALUE]->value + 3)));
+            ESP_LOGD(state_name(), "Modulating, raising target, pendel_target: %f", input[TEMP_NEW_TARGET]->value);
+        }
+        else if ((delta + (derivative_D_5 * 30)) < 0)
+        {
+            // 5: above target with no modulation, so those tricks are gone. It will still not be fixed next 30 minutes
+            // not while preheating for a defrost, the raised stooklijn is expected to be below target for a while
+            // with backup_duty_cycle the duty cycle in STALL handles this
+            if (!backup_duty_cycle && input[OAT]->value < config.backup_heater_active_temp && !sensors.relay_backup_heat && current_defrost_offset == 0)
+            {
+                // through backup_heat() so the relay_heat/relay_pump interlocks apply
+                backup_heat(true);
+                ESP_LOGD(state_name(), "tracking_value stalled, switched backup_heater on");
+            }
+        }
+        else
+        {
+            // Waiting for delta te become within range
+            ESP_LOGD(state_name(), "Stall is waiting for next action (or out of options).");
+        }
+        SEQUENCE_YIELD(frame);
+    }
+    SEQUENCE_END(frame);
+}
+sequence_results state_machine_class::defrost_sequence(sequence_frame_struct &frame)
+{
+    SEQUENCE_BEGIN(frame);
+    do
+    {
+        SEQUENCE_AWAIT_INPUT(frame, DEFROST_RUN, false, sequence_forever);
+        // 10 minute delay (defrost takes 4 minutes) some additional delay to allow values to stabilize and backup heater to run
+        // unless heat was banked ahead of the defrost and the compressor is back on target after a short recovery
+        // a new defrost in the meantime waits for its end again
+        SEQUENCE_AWAIT(frame, input[DEFROST_RUN]->state || (defrost_heat_banked && input[COMPRESSOR]->state && delta >= 0 && input[DEFROST_RUN]->seconds_since_change() >= (uint_fast32_t)defrost_recovery_time), state_start_time + (10 * 60));
+    } while (input[DEFROST_RUN]->state);
+    if (!input[THERMOSTAT_SENSOR]->state)
+    {
+        // straight off if no thermostat signal after SWW (ignore delay)
+        state_transition(AFTERRUN, CAUSE_DEFROST_DONE);
+    }
+    else if (input[COMPRESSOR]->state)
+    {
+        if (delta > 0)
+        {
+            backup_heat(false);
+            state_transition(RUN, CAUSE_DEFROST_DONE);
+        }
+        else
+        {
+            state_transition(STALL, CAUSE_DEFROST_DONE);
+        }
+    }
+    else
+    {
+        backup_heat(false);
+        state_transition(WAIT, CAUSE_DEFROST_DONE);
+    }
+    SEQUENCE_END(frame);
+}
+sequence_results state_machine_class::afterrun_sequence(sequence_frame_struct &frame)
+{
+    SEQUENCE_BEGIN(frame);
+    // Timeout
+    SEQUENCE_AWAIT_UNTIL(frame, state_start_time + (uint_fast32_t)(config.external_pump_runover * 60));
+    state_transition(IDLE, CAUSE_AFTERRUN_DONE);
+    SEQUENCE_END(frame);
+}
+//***************************************************************
+//*******************Timers**************************************
+//***************************************************************
+// fire the deadlines reached by run_time, call after increment_run_time. The cycle is the only tick the controller has,
+// a handful of timers is checked in one pass over the armed ones
+void state_machine_class::advance_timers()
+{
+    uint32_t armed = armed_timers;
+    for (int timer = 0; armed != 0; timer++, armed >>= 1)
+    {
+        if ((armed & 1) && timer_deadlines[timer] <= get_run_time())
+        {
+            armed_timers &= ~(1u << timer);
+            timer_fired((timer_ids)timer);
+        }
+    }
+}
+// (re)arm a timer, a deadline that already passed fires immediately so the caller sees it expired in the same cycle
+void state_machine_class::arm_timer(timer_ids timer, uint_fast32_t deadline)
+{
+    expired_timers &= ~(1u << timer);
+    if (deadline <= get_run_time())
+    {
+        armed_timers &= ~(1u << timer);
+        timer_fired(timer);
+        return;
+    }
+    timer_deadlines[timer] = deadline;
+    armed_timers |= (1u << timer);
+}
+void state_machine_class::cancel_timer(timer_ids timer)
+{
+    armed_timers &= ~(1u << timer);
+    expired_timers &= ~(1u << timer);
+}
+bool state_machine_class::timer_expired(timer_ids timer)
+{
+    return expired_timers & (1u << timer);
+}
+void state_machine_class::timer_fired(timer_ids timer)
+{
+    expired_timers |= (1u << timer);
+    metrics_struct::add(metrics.timers_fired);
+}
+// the deadlines that depend on the config, the delays are in minutes and a deadline is the first second past the delay
+void state_machine_class::rearm_timers()
+{
+    float thermostat_delay = input[THERMOSTAT_SENSOR]->state ? config.thermostat_on_delay : config.thermostat_off_delay;
+    arm_timer(TIMER_THERMOSTAT_DELAY, input[THERMOSTAT_SENSOR]->input_change_time + (uint_fast32_t)(thermostat_delay * 60) + 1);
+    arm_timer(TIMER_MINIMUM_RUN, run_start_time + (uint_fast32_t)(config.minimum_run_time * 60) + 1);
+    if (input[BOOST]->state)
+        arm_timer(TIMER_BOOST, input[BOOST]->input_change_time + (uint_fast32_t)(config.boost_time * 60) + 1);
+}
+//***************************************************************
 //*******************Stooklijn***********************************
 //***************************************************************
 // calculate stooklijn function
 float state_machine_class::calculate_stooklijn()
 {
+    profile_scope_struct profile(metrics.functions[PROFILE_CALCULATE_STOOKLIJN]);
     // Calculate stooklijn target
+    metrics_struct::add(metrics.stooklijn_recalculations);
     // Hold previous script run oat value
-    static float prev_oat = 20; // oat at minimum water temp (20/20) to prevent strange events on startup
     // wait for a valid oat reading
     float oat = 20;
     if (input[OAT]->value > 60 || input[OAT]->value < -50 || isnan(input[OAT]->value))
@@ -896,7 +1956,8 @@ float state_machine_class::calculate_stooklijn()
     }
     else
     {
-        prev_oat = input[OAT]->value;
+        oat = input[OAT]->value;
+        prev_oat = oat;
         update_stooklijn_bool = false;
     }
     float new_stooklijn_target;
@@ -906,24 +1967,42 @@ float state_machine_class::calculate_stooklijn()
     // C is the curvature of the stooklijn defined by C = (stooklijn_curve*0.001)*(oat-max_oat)^2
     // This will add a positive offset with decreasing offset. You can set this to zero if you don't need it and want a linear stooklijn
     // I need it in my installation as the stooklijn is spot on at relative high temperatures, but too low at lower temps
-    const float Z = 0 - (float)((id(stooklijn_max_wtemp).state - id(stooklijn_min_wtemp).state) / (id(stooklijn_min_oat).state - id(stooklijn_max_oat).state));
     // If oat above or below maximum/minimum oat, clamp to stooklijn_max/min value
-    float oat_value = input[OAT]->value;
-    if (oat_value > id(stooklijn_max_oat).state)
-        oat_value = id(stooklijn_max_oat).state;
-    else if (oat_value < id(stooklijn_min_oat).state)
-        oat_value = id(stooklijn_min_oat).state;
-    float C = (id(stooklijn_curve).state * 0.001) * pow((oat_value - id(stooklijn_max_oat).state), 2);
-    new_stooklijn_target = (int)round((Z * (id(stooklijn_max_oat).state - oat_value)) + id(stooklijn_min_wtemp).state + C);
+    float oat_value = oat;
+    if (oat_value > config.stooklijn_max_oat)
+        oat_value = config.stooklijn_max_oat;
+    else if (oat_value < config.stooklijn_min_oat)
+        oat_value = config.stooklijn_min_oat;
+#ifdef LG_FIXED_POINT_CONTROL
+    const q16_t Z_q = -q16_div(to_q16(config.stooklijn_max_wtemp) - to_q16(config.stooklijn_min_wtemp), to_q16(config.stooklijn_min_oat) - to_q16(config.stooklijn_max_oat));
+    const q16_t oat_distance = to_q16(oat_value) - to_q16(config.stooklijn_max_oat);
+    // curve * 0.001 * distance^2, divide last to keep the precision
+    const q16_t C_q = q16_mul(to_q16(config.stooklijn_curve), q16_mul(oat_distance, oat_distance)) / 1000;
+    const float Z = from_q16(Z_q);
+    const float C = from_q16(C_q);
+    new_stooklijn_target = from_q16(q16_round(q16_mul(Z_q, -oat_distance) + to_q16(config.stooklijn_min_wtemp) + C_q));
+#else
+    const float Z = 0 - (float)((config.stooklijn_max_wtemp - config.stooklijn_min_wtemp) / (config.stooklijn_min_oat - config.stooklijn_max_oat));
+    float C = (config.stooklijn_curve * 0.001) * pow((oat_value - config.stooklijn_max_oat), 2);
+    new_stooklijn_target = (int)round((Z * (config.stooklijn_max_oat - oat_value)) + config.stooklijn_min_wtemp + C);
+#endif // LG_FIXED_POINT_CONTROL
+    // the learned house replaces the curve when enabled, the offsets and the clamp still apply
+    float model_target = building_model.supply_temp(config.room_temp_target, oat_value);
+    if (building_model_stooklijn && !isnan(model_target))
+        new_stooklijn_target = round(model_target);
     // Add stooklijn offset
-    new_stooklijn_target = new_stooklijn_target + id(wp_stooklijn_offset).state;
+    new_stooklijn_target = new_stooklijn_target + config.wp_stooklijn_offset;
     // Add boost offset
     new_stooklijn_target = new_stooklijn_target + current_boost_offset;
+    // Add defrost preheat offset
+    new_stooklijn_target = new_stooklijn_target + current_defrost_offset;
+    // Add room compensation
+    new_stooklijn_target = new_stooklijn_target + current_room_offset;
     // Clamp target to minimum temp/max water+3
-    clamp(new_stooklijn_target, id(stooklijn_min_wtemp).state, id(stooklijn_max_wtemp).state + 3);
-    ESP_LOGD("calculate_stooklijn", "Stooklijn calculated with oat: %f, Z: %f, C: %f offset: %f, result: %f", input[OAT]->value, Z, C, id(wp_stooklijn_offset).state, new_stooklijn_target);
+    clamp(new_stooklijn_target, config.stooklijn_min_wtemp, config.stooklijn_max_wtemp + 3);
+    ESP_LOGD("calculate_stooklijn", "Stooklijn calculated with oat: %f, Z: %f, C: %f offset: %f, result: %f", input[OAT]->value, Z, C, config.wp_stooklijn_offset, new_stooklijn_target);
     // Publish new stooklijn value to watertemp value sensor
-    id(watertemp_target).publish_state(new_stooklijn_target);
+    output(OUTPUT_WATERTEMP_TARGET, new_stooklijn_target);
     return new_stooklijn_target;
 }
 //***************************************************************
@@ -931,6 +2010,13 @@ float state_machine_class::calculate_stooklijn()
 //***************************************************************
 bool state_machine_class::thermostat_state()
 {
+    profile_scope_struct profile(metrics.functions[PROFILE_THERMOSTAT_STATE]);
+    // the on or off delay runs from the last sensor change
+    if (input[THERMOSTAT_SENSOR]->has_flag())
+    {
+        float thermostat_delay = input[THERMOSTAT_SENSOR]->state ? config.thermostat_on_delay : config.thermostat_off_delay;
+        arm_timer(TIMER_THERMOSTAT_DELAY, input[THERMOSTAT_SENSOR]->input_change_time + (uint_fast32_t)(thermostat_delay * 60) + 1);
+    }
     // if sensor and thermostat are the same, just return
     if (input[THERMOSTAT_SENSOR]->state == input[THERMOSTAT]->state)
         return input[THERMOSTAT]->state;
@@ -942,7 +2028,7 @@ bool state_machine_class::thermostat_state()
     {
         // state change is a switch to on
         // check if on delay has passed
-        if (input[THERMOSTAT_SENSOR]->seconds_since_change() > (id(thermostat_on_delay).state * 60))
+        if (timer_expired(TIMER_THERMOSTAT_DELAY))
             return true;
     }
     else
@@ -952,10 +2038,10 @@ bool state_machine_class::thermostat_state()
         if (!input[COMPRESSOR]->state || state() == SWW || state() == DEFROST)
             return false;
         // check if off delay time has passed
-        if (input[THERMOSTAT_SENSOR]->seconds_since_change() > (id(thermostat_off_delay).state * 60))
+        if (timer_expired(TIMER_THERMOSTAT_DELAY))
         {
             // then check if minimum run time has passed
-            if ((get_run_time() - run_start_time) > (id(minimum_run_time).state * 60))
+            if (timer_expired(TIMER_MINIMUM_RUN))
                 return false;
         }
     }
@@ -963,35 +2049,145 @@ bool state_machine_class::thermostat_state()
     return input[THERMOSTAT]->state;
 }
 //***************************************************************
+//*******************Zones***************************************
+//***************************************************************
+// register a zone demand input, call from on_boot. Returns the zone index or -1 if all zones are used
+int state_machine_class::add_zone(std::function<bool()> demand, float weight, uint_fast32_t on_delay, uint_fast32_t off_delay)
+{
+    if (zone_count >= max_zones || weight <= 0)
+        return -1;
+    zone_struct &zone = zones[zone_count];
+    zone.demand = demand;
+    zone.weight = weight;
+    zone.on_delay = on_delay;
+    zone.off_delay = off_delay;
+    zone_total_weight += weight;
+    return zone_count++;
+}
+// the combined demand only starts a run when enough zones (by weight) ask for heat, a small zone alone does not
+// the per zone delays and the thermostat on/off delays in thermostat_state() both apply
+bool state_machine_class::update_zones()
+{
+    for (int i = 0; i < zone_count; i++)
+    {
+        zone_struct &zone = zones[i];
+        bool raw = sensors.zone_demand[i];
+        if (raw != zone.raw)
+        {
+            zone.raw = raw;
+            arm_timer((timer_ids)(TIMER_ZONE + i), get_run_time() + (zone.raw ? zone.on_delay : zone.off_delay));
+        }
+        if (zone.active != zone.raw && timer_expired((timer_ids)(TIMER_ZONE + i)))
+        {
+            zone.active = zone.raw;
+            zone_active_weight += zone.active ? zone.weight : -zone.weight;
+            if (zone_active_weight < 0)
+                zone_active_weight = 0;
+            ESP_LOGD(state_name(), "Zone %d demand %s, active weight %f of %f", i, zone.active ? "on" : "off", zone_active_weight, zone_total_weight);
+        }
+    }
+    float fraction = zone_active_weight / zone_total_weight;
+    bool demand = zone_demand;
+    if (!zone_demand && fraction >= zone_start_demand)
+        zone_demand = true;
+    else if (zone_demand && fraction <= zone_stop_demand)
+        zone_demand = false;
+    // thermostat_signal shows the combined demand
+    if (zone_demand != demand || !zone_demand_published)
+        output(OUTPUT_THERMOSTAT_SIGNAL, zone_demand);
+    zone_demand_published = true;
+    return zone_demand;
+}
+//***************************************************************
 //*******************Derivative**********************************
 //***************************************************************
+void derivative_ring_struct::push(float value)
+{
+    values[head] = value;
+    head = (head + 1) % size;
+    if (count < size)
+        count++;
+}
+float derivative_ring_struct::back(int age)
+{
+    return values[(head - 1 - age + 2 * size) % size];
+}
+void derivative_ring_struct::clear()
+{
+    count = 0;
+    head = 0;
+}
+// a cycle without a new modbus read keeps the value, a nan read is passed on (counted as a modbus read error)
+float signal_filter_struct::update(float sample, uint32_t updated_ms)
+{
+    rejected = false;
+    if (isnan(sample))
+        return sample;
+    if (count > 0 && updated_ms == sample_ms)
+        return value;
+    sample_ms = updated_ms;
+    samples[head] = sample;
+    head = (head + 1) % 3;
+    if (count < 3)
+        count++;
+    value = sample;
+    if (count < 3)
+        return value;
+    float median = max(min(samples[0], samples[1]), min(max(samples[0], samples[1]), samples[2]));
+    // a real step is taken over by the next read, a single glitch is not
+    if (fabs(sample - median) > outlier_limit)
+    {
+        rejected = true;
+        value = median;
+    }
+    return value;
+}
 void state_machine_class::calculate_derivative(float tracking_value)
 {
-    float d_number = tracking_value;
-    derivative.push_back(d_number);
-    // limit size to 31 elements(15 minutes)
-    if (derivative.size() > 31)
-        derivative.erase(derivative.begin());
+    profile_scope_struct profile(metrics.functions[PROFILE_CALCULATE_DERIVATIVE]);
+    // the ring keeps the last 31 elements (15 minutes)
+    derivative.push(tracking_value);
     // calculate current derivative for 5 and 10 minutes
     // derivative is measured in degrees/minute
     derivative_D_5 = 0;
     derivative_D_10 = 0;
     // wait until derivative > 14, this makes sure the first 2 minutes are skipped
     // first minute or so is unreliabel if pump has been off for a while (water cools in the unit)
-    if (derivative.size() > 14)
+#ifdef LG_FIXED_POINT_CONTROL
+    q16_t D_5 = 0;
+    q16_t D_10 = 0;
+    if (derivative.count > 14)
     {
-        derivative_D_5 = (derivative.back() - derivative.at(derivative.size() - 11)) / 10;
+        D_5 = (to_q16(derivative.back()) - to_q16(derivative.back(10))) / 10;
     }
-    if (derivative.size() > 24)
+    if (derivative.count > 24)
     {
-        derivative_D_10 = (derivative.back() - derivative.at(derivative.size() - 21)) / 20;
+        D_10 = (to_q16(derivative.back()) - to_q16(derivative.back(20))) / 20;
+    }
+    derivative_D_5 = from_q16(D_5);
+    derivative_D_10 = from_q16(D_10);
+    // make sure there is always a prediction even with derivative = 0
+    const q16_t tracking = to_q16(tracking_value);
+    const q16_t target = to_q16(input[STOOKLIJN_TARGET]->value);
+    pred_20_delta_5 = from_q16(tracking + D_5 * 20 - target);
+    pred_20_delta_10 = from_q16(tracking + D_10 * 20 - target);
+    pred_5_delta_5 = from_q16(tracking + D_5 * 5 - target);
+#else
+    if (derivative.count > 14)
+    {
+        derivative_D_5 = (derivative.back() - derivative.back(10)) / 10;
+    }
+    if (derivative.count > 24)
+    {
+        derivative_D_10 = (derivative.back() - derivative.back(20)) / 20;
     }
     // make sure there is always a prediction even with derivative = 0
     pred_20_delta_5 = (tracking_value + (derivative_D_5 * 20)) - input[STOOKLIJN_TARGET]->value;
     pred_20_delta_10 = (tracking_value + (derivative_D_10 * 20)) - input[STOOKLIJN_TARGET]->value;
     pred_5_delta_5 = (tracking_value + (derivative_D_5 * 5)) - input[STOOKLIJN_TARGET]->value;
+#endif // LG_FIXED_POINT_CONTROL
     // publish new value
-    id(derivative_value).publish_state(derivative_D_10 * 60);
+    output(OUTPUT_DERIVATIVE_VALUE, derivative_D_10 * 60);
 }
 //***************************************************************
 //*******************Heat****************************************
@@ -1000,9 +2196,10 @@ void state_machine_class::heat(bool mode)
 {
     if (mode)
     {
-        if (!id(relay_heat).state)
+        if (actuator_request(RELAY_HEAT, true, sensors.relay_heat))
         {
-            id(relay_heat).turn_on();
+            output(OUTPUT_RELAY_HEAT, 1);
+            transition_trace.actuator(get_run_time(), RELAY_HEAT, 1);
             input[RELAY_HEAT]->receive_state(true);
         }
         // if relay heat is turned on, relay_pump must also be turned on
@@ -1010,14 +2207,15 @@ void state_machine_class::heat(bool mode)
         {
             external_pump(true);
             ESP_LOGD(state_name(), "Invalid configuration relay_heat on before relay_pump.");
-            id(controller_info).publish_state("Invalid config: heat on before pump.");
+            publish_info("Invalid config: heat on before pump.");
         }
     }
     else
     {
-        if (id(relay_heat).state)
+        if (actuator_request(RELAY_HEAT, false, sensors.relay_heat))
         {
-            id(relay_heat).turn_off();
+            output(OUTPUT_RELAY_HEAT, 0);
+            transition_trace.actuator(get_run_time(), RELAY_HEAT, 0);
             input[RELAY_HEAT]->receive_state(false);
         }
         // external pump can remain on, backup heater must be off
@@ -1025,9 +2223,72 @@ void state_machine_class::heat(bool mode)
         {
             backup_heat(false);
             ESP_LOGD(state_name(), "Invalid configuration relay_heat off before relay_backup_heat off.");
-            id(controller_info).publish_state("Invalid config: heat off before backup_heat");
+            publish_info("Invalid config: heat off before backup_heat");
+        }
+    }
+}
+//***************************************************************
+//*******************Actuator dwell******************************
+//***************************************************************
+bool actuator_struct::allow(bool on, uint_fast32_t run_time)
+{
+    if (!switched_once)
+        return true;
+    if (run_time - last_switch_time < (on ? min_off_time : min_on_time))
+        return false;
+    if (max_switches_per_hour > 0 && run_time - window_start < 3600 && window_switches >= max_switches_per_hour)
+        return false;
+    return true;
+}
+void actuator_struct::switched(uint_fast32_t run_time)
+{
+    if (!switched_once || run_time - window_start >= 3600)
+    {
+        window_start = run_time;
+        window_switches = 0;
+    }
+    window_switches++;
+    last_switch_time = run_time;
+    switched_once = true;
+}
+// central gate for relay and coil switches, returns true if the caller may switch the output now
+// commands that match the current state cost nothing, so the FSM can repeat them every cycle
+bool state_machine_class::actuator_request(input_types actuator, bool on, bool current)
+{
+    actuator_struct &output = actuators[actuator];
+    output.requested = on;
+    if (on == current)
+    {
+        output.pending = false;
+        return false;
+    }
+    // the interlocks and the safe states rely on these, never delay them. Boost has no dwell at all
+    bool safe_direction = (actuator == RELAY_HEAT && !on) || (actuator == EXTERNAL_PUMP && on) || (actuator == BACKUP_HEAT && !on);
+    if (!safe_direction && !output.allow(on, get_run_time()))
+    {
+        if (!output.pending)
+        {
+            metrics_struct::add(metrics.actuator_deferred[actuator]);
+            ESP_LOGD(state_name(), "%s %s delayed by dwell time or switch rate", input_type_names[actuator], on ? "on" : "off");
         }
+        output.pending = true;
+        return false;
     }
+    output.pending = false;
+    output.switched(get_run_time());
+    return true;
+}
+// retry commands that were delayed, through the helpers so the interlocks still apply
+void state_machine_class::apply_pending_actuators()
+{
+    if (actuators[RELAY_HEAT].pending)
+        heat(actuators[RELAY_HEAT].requested);
+    if (actuators[EXTERNAL_PUMP].pending)
+        external_pump(actuators[EXTERNAL_PUMP].requested);
+    if (actuators[BACKUP_HEAT].pending)
+        backup_heat(actuators[BACKUP_HEAT].requested);
+    if (actuators[SILENT_MODE].pending)
+        silent_mode(actuators[SILENT_MODE].requested);
 }
 //***************************************************************
 //*******************Pump****************************************
@@ -1036,9 +2297,10 @@ void state_machine_class::external_pump(bool mode)
 {
     if (mode)
     {
-        if (!id(relay_pump).state)
+        if (actuator_request(EXTERNAL_PUMP, true, sensors.relay_pump))
         {
-            id(relay_pump).turn_on();
+            output(OUTPUT_RELAY_PUMP, 1);
+            transition_trace.actuator(get_run_time(), EXTERNAL_PUMP, 1);
             input[EXTERNAL_PUMP]->receive_state(true);
         }
     }
@@ -1048,18 +2310,25 @@ void state_machine_class::external_pump(bool mode)
         {
             heat(false);
             ESP_LOGD(state_name(), "Invalid configuration relay_pump off before relay_heat");
-            id(controller_info).publish_state("Invalid config: pump off before heat");
+            publish_info("Invalid config: pump off before heat");
         }
         // backup heater must be off
         if (input[BACKUP_HEAT]->state)
         {
             backup_heat(false);
             ESP_LOGD(state_name(), "Invalid configuration relay_pump off before relay_backup_heat");
-            id(controller_info).publish_state("Invalid config: pump off before backup_heat");
+            publish_info("Invalid config: pump off before backup_heat");
         }
-        if (id(relay_pump).state)
+        if (sensors.relay_heat)
         {
-            id(relay_pump).turn_off();
+            // relay_heat off was delayed, the pump follows once it is off
+            actuators[EXTERNAL_PUMP].requested = false;
+            actuators[EXTERNAL_PUMP].pending = true;
+        }
+        else if (actuator_request(EXTERNAL_PUMP, false, sensors.relay_pump))
+        {
+            output(OUTPUT_RELAY_PUMP, 0);
+            transition_trace.actuator(get_run_time(), EXTERNAL_PUMP, 0);
             input[EXTERNAL_PUMP]->receive_state(false);
         }
     }
@@ -1075,35 +2344,37 @@ void state_machine_class::backup_heat(bool mode, bool temp_limit_trigger)
         if (!input[RELAY_HEAT]->state)
         {
             // do not turn on
+            actuators[BACKUP_HEAT].pending = false;
             ESP_LOGD(state_name(), "Invalid configuration relay_backup_heat on before relay_heat.");
-            id(controller_info).publish_state("ERROR: backup_heat on before heat.");
+            publish_info("ERROR: backup_heat on before heat.");
         }
         else
         {
-            if (!id(relay_backup_heat).state)
+            if (actuator_request(BACKUP_HEAT, true, sensors.relay_backup_heat))
             {
-                id(relay_backup_heat).turn_on();
+                output(OUTPUT_RELAY_BACKUP_HEAT, 1);
+                transition_trace.actuator(get_run_time(), BACKUP_HEAT, 1);
                 input[BACKUP_HEAT]->receive_state(true);
                 if (temp_limit_trigger)
                 {
                     backup_heat_temp_limit_trigger = true;
-                    id(controller_info).publish_state("Backup heat on due to low temp");
+                    publish_info("Backup heat on due to low temp");
                 }
                 else if (input[SWW_RUN]->state)
                 {
-                    id(controller_info).publish_state("Backup heat on due to SWW run");
+                    publish_info("Backup heat on due to SWW run");
                 }
                 else if (input[DEFROST_RUN]->state)
                 {
-                    id(controller_info).publish_state("Backup heat on due to Defrost");
+                    publish_info("Backup heat on due to Defrost");
                 }
                 else if (state() == STALL)
                 {
-                    id(controller_info).publish_state("Backup heat on due to STALL");
+                    publish_info("Backup heat on due to STALL");
                 }
                 else
                 {
-                    id(controller_info).publish_state("Backup heat on");
+                    publish_info("Backup heat on");
                 }
             }
             // if relay_backup_heat is turned on, relay_pump must also be turned on
@@ -1111,22 +2382,58 @@ void state_machine_class::backup_heat(bool mode, bool temp_limit_trigger)
             {
                 external_pump(true);
                 ESP_LOGD(state_name(), "Invalid configuration relay_backup_heat on before relay_pump.");
-                id(controller_info).publish_state("Invalid config: backup_heat on before pump.");
+                publish_info("Invalid config: backup_heat on before pump.");
             }
             backup_heat_temp_limit_trigger = false;
         }
     }
     else
     {
-        if (id(relay_backup_heat).state)
+        if (actuator_request(BACKUP_HEAT, false, sensors.relay_backup_heat))
         {
-            id(relay_backup_heat).turn_off();
+            output(OUTPUT_RELAY_BACKUP_HEAT, 0);
+            transition_trace.actuator(get_run_time(), BACKUP_HEAT, 0);
             input[BACKUP_HEAT]->receive_state(false);
             backup_heat_temp_limit_trigger = false;
         }
         // all else can remain on
     }
 }
+// time proportioning in a fixed window: on for duty * window at the start of each window
+// the duty is recalculated at the window start, so the relay switches at most twice per window
+void state_machine_class::backup_heat_duty_cycle(float deficit)
+{
+    // low temp always on and defrost preheat keep their own backup heat behaviour
+    bool allowed = input[OAT]->value < config.backup_heater_active_temp && !check_low_temp_trigger() && current_defrost_offset == 0;
+    if (!allowed || (!backup_duty_active && deficit <= 0))
+    {
+        if (backup_duty_active)
+        {
+            backup_duty_active = false;
+            backup_heat(false);
+            ESP_LOGD(state_name(), "Backup heat duty cycle stopped");
+        }
+        return;
+    }
+    if (!backup_duty_active || timer_expired(TIMER_BACKUP_DUTY_WINDOW))
+    {
+        float duty = deficit * backup_duty_gain;
+        if (duty < 0)
+            duty = 0;
+        else if (duty > 1)
+            duty = 1;
+        backup_duty_on_time = duty * backup_duty_window;
+        if (backup_duty_on_time < (uint_fast32_t)backup_duty_min_on)
+            backup_duty_on_time = 0;
+        else if (backup_duty_window - backup_duty_on_time < (uint_fast32_t)backup_duty_min_off)
+            backup_duty_on_time = backup_duty_window;
+        arm_timer(TIMER_BACKUP_DUTY_WINDOW, get_run_time() + (uint_fast32_t)backup_duty_window);
+        arm_timer(TIMER_BACKUP_DUTY_ON, get_run_time() + backup_duty_on_time);
+        backup_duty_active = true;
+        ESP_LOGD(state_name(), "Backup heat duty cycle: deficit %f, on %d of %d seconds", deficit, (int)backup_duty_on_time, backup_duty_window);
+    }
+    backup_heat(!timer_expired(TIMER_BACKUP_DUTY_ON));
+}
 //***************************************************************
 //*******************Boost***************************************
 //***************************************************************
@@ -1135,12 +2442,18 @@ void state_machine_class::boost(bool mode)
     if (mode)
     {
         if (!input[BOOST]->state)
-            id(boost_switch).turn_on();
+        {
+            output(OUTPUT_BOOST_SWITCH, 1);
+            transition_trace.actuator(get_run_time(), BOOST, 1);
+        }
     }
     else
     {
         if (input[BOOST]->state)
-            id(boost_switch).turn_off();
+        {
+            output(OUTPUT_BOOST_SWITCH, 0);
+            transition_trace.actuator(get_run_time(), BOOST, 0);
+        }
     }
 }
 void state_machine_class::toggle_boost()
@@ -1149,38 +2462,167 @@ void state_machine_class::toggle_boost()
     {
         current_boost_offset = boost_offset;
         input[STOOKLIJN_TARGET]->receive_value(calculate_stooklijn());
-        id(controller_info).publish_state("Boost mode active");
+        publish_info("Boost mode active");
     }
     else
     {
         current_boost_offset = 0;
         input[STOOKLIJN_TARGET]->receive_value(calculate_stooklijn());
-        id(controller_info).publish_state("Boost mode deactivated");
+        publish_info("Boost mode deactivated");
     }
 }
 //***************************************************************
-//*******************Silent mode logic***************************
+//*******************Defrost prediction**************************
 //***************************************************************
-void state_machine_class::silent_mode(bool mode)
+void state_machine_class::update_defrost_prediction()
 {
-    if (mode)
+    defrost_predictor.update(get_run_time(), input[COMPRESSOR]->state, input[DEFROST_RUN]->state, input[OAT]->value, sensors.compressor_hz, defrost_preheat_window);
+    if (input[DEFROST_RUN]->has_flag())
     {
-        if (!input[SILENT_MODE]->state)
+        if (input[DEFROST_RUN]->state)
+        {
+            // remember if the preheat banked enough heat to ride out the defrost without backup heat, without a preheat
+            // nothing was banked
+            defrost_heat_banked = current_defrost_offset > 0 && input[TRACKING_VALUE]->value >= (input[STOOKLIJN_TARGET]->value - current_defrost_offset);
+            uint_fast32_t predicted_count = defrost_predictor.predicted_count;
+            defrost_predictor.defrost_start(get_run_time(), input[OAT]->value);
+            if (defrost_predictor.predicted_count != predicted_count)
+            {
+                metrics_struct::add(metrics.defrosts_predicted);
+                metrics.defrost_prediction_error_s.store((uint32_t)lroundf(defrost_predictor.mean_abs_error), std::memory_order_relaxed);
+            }
+            else
+            {
+                metrics_struct::add(metrics.defrosts_missed);
+            }
+        }
+        else
         {
-            id(silent_mode_switch).turn_on();
-            id(silent_mode_state).publish_state(true);
-            input[SILENT_MODE]->receive_state(true);
+            defrost_predictor.defrost_end();
         }
     }
-    else
+    // raise stooklijn ahead of the predicted defrost to bank heat in the loop, only while heating
+    int offset = 0;
+    if (defrost_predictor.predicted_seconds >= 0 && defrost_predictor.predicted_seconds <= defrost_preheat_window && (state() == RUN || state() == STALL || state() == OVERSHOOT))
+        offset = defrost_preheat_offset;
+    if (offset != current_defrost_offset)
     {
-        if (input[SILENT_MODE]->state)
+        current_defrost_offset = offset;
+        input[STOOKLIJN_TARGET]->receive_value(calculate_stooklijn());
+        if (offset > 0)
+        {
+            ESP_LOGD(state_name(), "Defrost predicted in %d seconds, preheat active", (int)defrost_predictor.predicted_seconds);
+            publish_info("Defrost predicted: preheat active");
+        }
+        else
         {
-            id(silent_mode_switch).turn_off();
-            id(silent_mode_state).publish_state(false);
-            input[SILENT_MODE]->receive_state(false);
+            publish_info("Defrost preheat deactivated");
         }
     }
+    output(OUTPUT_DEFROST_PREDICTION, defrost_predictor.predicted_seconds >= 0 ? defrost_predictor.predicted_seconds / 60.0 : NAN);
+}
+//***************************************************************
+//*******************Room compensation***************************
+//***************************************************************
+// incremental (velocity form) PI on the room temperature on top of the weather compensation
+// the clamp on the output is the anti-windup, the step per update is rate limited
+void state_machine_class::update_room_compensation(uint_fast32_t dt)
+{
+    float room_temp = sensors.room_temp;
+    // only integrate while heating and with a plausible room temperature, hold the correction otherwise
+    bool heating = state() == STABILIZE || state() == RUN || state() == OVERSHOOT || state() == STALL;
+    if (!room_compensation || !heating || isnan(room_temp) || room_temp < 0 || room_temp > 40)
+    {
+        if (!room_compensation)
+            room_correction = 0;
+        prev_room_error = NAN;
+    }
+    else
+    {
+        // positive error: room too cold, raise the water temperature
+        float error = config.room_temp_target - room_temp;
+        float step = room_kp * (error * dt / room_ti);
+        if (!isnan(prev_room_error))
+            step += room_kp * (error - prev_room_error);
+        prev_room_error = error;
+        float max_step = room_max_rate * dt / 3600;
+        if (step > max_step)
+            step = max_step;
+        else if (step < -max_step)
+            step = -max_step;
+        room_correction += step;
+        if (room_correction > room_max_correction)
+            room_correction = room_max_correction;
+        else if (room_correction < -room_max_correction)
+            room_correction = -room_max_correction;
+    }
+    int offset = round(room_correction);
+    if (offset != current_room_offset)
+    {
+        current_room_offset = offset;
+        input[STOOKLIJN_TARGET]->receive_value(calculate_stooklijn());
+        ESP_LOGD(state_name(), "Room compensation: room %f target %f, stooklijn offset %d", room_temp, config.room_temp_target, offset);
+    }
+    output(OUTPUT_ROOM_COMPENSATION_VALUE, room_correction);
+}
+//***************************************************************
+//*******************Building model******************************
+//***************************************************************
+void state_machine_class::update_building_model()
+{
+    float room_temp = sensors.room_temp;
+    // during SWW and defrost the water temperatures do not describe the heating circuit
+    if (state() == SWW || state() == DEFROST)
+        return;
+    building_model.update(get_run_time(), input[OAT]->value, room_temp, sensors.water_temp_aanvoer, sensors.water_temp_retour, sensors.current_flow_rate);
+    if (building_model.samples == building_model_saved)
+        return;
+    building_model_saved = building_model.samples;
+    // globals with restore_value, ESPHome writes them to flash. They belong to the ESPHome loop
+    output(OUTPUT_BUILDING_HEAT_LOSS, building_model.heat_loss());
+    output(OUTPUT_BUILDING_TIME_CONSTANT, building_model.time_constant());
+    output(OUTPUT_BUILDING_EMITTER_COEFFICIENT, building_model.k);
+    output(OUTPUT_BUILDING_MODEL_SAMPLES, building_model.samples);
+    if (building_model.valid())
+    {
+        output(OUTPUT_BUILDING_HEAT_LOSS_VALUE, building_model.heat_loss());
+        output(OUTPUT_BUILDING_TIME_CONSTANT_VALUE, building_model.time_constant());
+    }
+}
+// restore the persisted building model, call from on_boot
+void state_machine_class::load_building_model()
+{
+    building_model.load(id(building_heat_loss), id(building_time_constant), id(building_emitter_coefficient), id(building_model_samples));
+    building_model_saved = building_model.samples;
+    ESP_LOGD("building_model", "Restored: heat loss %f W/K, time constant %f h, %u samples", building_model.heat_loss(), building_model.time_constant(), (unsigned)building_model.samples);
+}
+//***************************************************************
+//*******************Silent mode logic***************************
+//***************************************************************
+// reason is published once, when the write is queued. A switch delayed by the dwell keeps it for the retry
+void state_machine_class::silent_mode(bool mode, const char *reason)
+{
+    // the remote changed silent mode, leave it alone while the override is held
+    if (write_held(SILENT_MODE))
+        return;
+    if (reason != nullptr)
+        silent_mode_reason = reason;
+    if (!actuator_request(SILENT_MODE, mode, input[SILENT_MODE]->state))
+    {
+        // already in that mode, a delayed switch that is no longer wanted takes its reason with it
+        if (!actuators[SILENT_MODE].pending)
+            silent_mode_reason = nullptr;
+        return;
+    }
+    queue_write(SILENT_MODE, mode ? 1 : 0);
+    output(OUTPUT_SILENT_MODE_STATE, mode ? 1 : 0);
+    input[SILENT_MODE]->receive_state(mode);
+    if (silent_mode_reason != nullptr)
+    {
+        ESP_LOGD(state_name(), "%s", silent_mode_reason);
+        publish_info(silent_mode_reason);
+        silent_mode_reason = nullptr;
+    }
 }
 void state_machine_class::toggle_silent_mode()
 {
@@ -1188,48 +2630,32 @@ void state_machine_class::toggle_silent_mode()
     // if input[OAT]->value <= silent always off: silent off
     // if in between: if boost or stall silent off otherwise silent on
 
-    if (input[OAT]->value >= id(oat_silent_always_on).state)
+    if (input[OAT]->value >= config.oat_silent_always_on)
     {
         if (!input[SILENT_MODE]->state)
-        {
-            ESP_LOGD(state_name(), "oat > oat_silent_always_on and silent mode off, switching silent mode on");
-            id(controller_info).publish_state("Switching Silent mode on oat > on");
-            silent_mode(true);
-        }
+            silent_mode(true, "Switching Silent mode on oat > on");
     }
-    else if (input[OAT]->value <= id(oat_silent_always_off).state)
+    else if (input[OAT]->value <= config.oat_silent_always_off)
     {
         if (input[SILENT_MODE]->state)
-        {
-            ESP_LOGD(state_name(), "Oat < oat_silent_always_off Switching silent mode off");
-            id(controller_info).publish_state("Switching silent mode off oat < oat_silent_always_off");
-            silent_mode(false);
-        }
+            silent_mode(false, "Switching silent mode off oat < oat_silent_always_off");
     }
     else
     {
         if (input[BOOST]->state || state() == STALL)
         {
             if (input[SILENT_MODE]->state)
-            {
-                ESP_LOGD(state_name(), "OAT between silent mode brackets. Boost or stall silent mode off");
-                id(controller_info).publish_state("STALL/Boost switching silent mode off");
-                silent_mode(false);
-            }
+                silent_mode(false, "STALL/Boost switching silent mode off");
         }
         else if (!input[SILENT_MODE]->state)
-        {
-            ESP_LOGD(state_name(), "OAT between silent mode brackets. No boost/stall switching silent on");
-            id(controller_info).publish_state("Switching silent mode on oat in between");
-            silent_mode(true);
-        }
+            silent_mode(true, "Switching silent mode on oat in between");
     }
 }
 int state_machine_class::get_target_offset()
 {
     if (input[OAT]->value >= 10)
         return -3;
-    if (input[OAT]->value >= id(oat_silent_always_on).state)
+    if (input[OAT]->value >= config.oat_silent_always_on)
         return -2;
     return -1;
 }
@@ -1241,23 +2667,26 @@ void state_machine_class::set_new_target(float new_target)
 }
 void state_machine_class::start_events()
 {
-    events.clear();
+    event_count = 0;
 }
 void state_machine_class::add_event(input_types ev)
 {
-    events.push_back(ev);
+    if (event_count < 16)
+        events[event_count++] = ev;
 }
 bool state_machine_class::check_change_events()
 {
-    std::vector<input_types>::iterator it;
+    profile_scope_struct profile(metrics.functions[PROFILE_CHECK_CHANGE_EVENTS]);
+    input_types *it;
     bool state_change = false;
-    for (it = events.begin(); it != events.end(); it++)
+    for (it = events; it != events + event_count; it++)
     {
         if (*it == DEFROST_RUN)
         {
             if (input[DEFROST_RUN]->state)
             {
-                state_transition(DEFROST);
+                metrics_struct::add(metrics.events_fired[*it]);
+                state_transition(DEFROST, *it);
                 ESP_LOGD(state_name(), "DEFROST run detected next state: DEFROST");
                 state_change = true;
             }
@@ -1266,7 +2695,8 @@ bool state_machine_class::check_change_events()
         {
             if (input[SWW_RUN]->state && !input[DEFROST_RUN]->state)
             {
-                state_transition(SWW);
+                metrics_struct::add(metrics.events_fired[*it]);
+                state_transition(SWW, *it);
                 ESP_LOGD(state_name(), "SWW run detected next state: SWW");
                 state_change = true;
             }
@@ -1275,9 +2705,10 @@ bool state_machine_class::check_change_events()
         {
             if (!input[THERMOSTAT]->state)
             {
+                metrics_struct::add(metrics.events_fired[*it]);
                 if (!input[SWW_RUN]->state && !input[DEFROST_RUN]->state)
                 {
-                    state_transition(AFTERRUN);
+                    state_transition(AFTERRUN, *it);
                     ESP_LOGD(state_name(), "THERMOSTAT OFF next state: AFTERRUN");
                     state_change = true;
                 }
@@ -1293,19 +2724,20 @@ bool state_machine_class::check_change_events()
         {
             if (!input[RELAY_HEAT]->state)
             {
+                metrics_struct::add(metrics.events_fired[*it]);
                 // relay_heat switched off. Check if thermostat still on (or on again)
                 if (input[THERMOSTAT]->state)
                 {
                     external_pump(true);
                     heat(true);
                     ESP_LOGD(state_name(), "RELAY_HEAT OFF, but thermostat_sensor on switched relay_heat back on");
-                    id(controller_info).publish_state("Heat switched off; thermostat on. Heat back on");
+                    publish_info("Heat switched off; thermostat on. Heat back on");
                 }
                 else if (!input[SWW_RUN]->state && !input[DEFROST_RUN]->state)
                 {
-                    state_transition(AFTERRUN);
+                    state_transition(AFTERRUN, *it);
                     ESP_LOGD(state_name(), "RELAY_HEAT OFF next state: AFTERRUN");
-                    id(controller_info).publish_state("Heat switched off. Aborting");
+                    publish_info("Heat switched off. Aborting");
                     state_change = true;
                 }
             }
@@ -1314,8 +2746,9 @@ bool state_machine_class::check_change_events()
         {
             if (!input[COMPRESSOR]->state)
             {
+                metrics_struct::add(metrics.events_fired[*it]);
                 // COMPRESSOR switched off. Failed run
-                state_transition(WAIT);
+                state_transition(WAIT, *it);
                 ESP_LOGD(state_name(), "Failed run detected next state: WAIT");
                 state_change = true;
             }
@@ -1324,7 +2757,8 @@ bool state_machine_class::check_change_events()
         {
             if (pendel_delta >= hysteresis)
             {
-                state_transition(OVERSHOOT);
+                metrics_struct::add(metrics.events_fired[*it]);
+                state_transition(OVERSHOOT, *it);
                 state_change = true;
             }
         }
@@ -1334,51 +2768,714 @@ bool state_machine_class::check_change_events()
             {
                 if (!input[RELAY_HEAT]->state || !input[THERMOSTAT]->state)
                 {
+                    metrics_struct::add(metrics.events_fired[*it]);
                     heat(false);
                     backup_heat(false);
                     ESP_LOGD(state_name(), "Backup heat off no heat request (relay_heat off)");
-                    id(controller_info).publish_state("Backup heat off due to no heat request");
+                    publish_info("Backup heat off due to no heat request");
                 }
-                else if (input[OAT]->value > id(backup_heater_active_temp).state)
+                else if (input[OAT]->value > config.backup_heater_active_temp)
                 {
+                    metrics_struct::add(metrics.events_fired[*it]);
                     backup_heat(false);
                     ESP_LOGD(state_name(), "Backup heat off input[OAT]->value > backup_heater_active_temp");
-                    id(controller_info).publish_state("Backup heat off due to high oat");
+                    publish_info("Backup heat off due to high oat");
                 }
-                else if (backup_heat_temp_limit_trigger && input[OAT]->value > id(backup_heater_always_on_temp).state)
+                else if (backup_heat_temp_limit_trigger && input[OAT]->value > config.backup_heater_always_on_temp)
                 {
+                    metrics_struct::add(metrics.events_fired[*it]);
                     // if triggered due to low temp and situation improved (with some hysteresis)
                     backup_heat(false);
                     ESP_LOGD(state_name(), "Backup heat off due to temperature improved");
-                    id(controller_info).publish_state("Backup heat off due to temperature improvement");
+                    publish_info("Backup heat off due to temperature improvement");
                 }
             }
         }
     }
-    events.clear();
+    event_count = 0;
     return state_change;
 }
 bool state_machine_class::compressor_modulation()
 {
-    if (input[SILENT_MODE]->state && id(compressor_rpm).state <= 50)
+    if (input[SILENT_MODE]->state && sensors.compressor_rpm <= 50)
         return true;
-    else if (!input[SILENT_MODE]->state && id(compressor_rpm).state <= 70)
+    else if (!input[SILENT_MODE]->state && sensors.compressor_rpm <= 70)
         return true;
     else
         return false;
 }
 bool state_machine_class::check_low_temp_trigger()
 {
-    return (input[OAT]->value <= id(backup_heater_always_on_temp).state);
+    return (input[OAT]->value <= config.backup_heater_always_on_temp);
 }
-// update target temp through modbus
+// update target temp through modbus, the write is queued and dispatched at the end of the cycle
 void state_machine_class::set_target_temp(float target)
 {
-    auto water_temp_call = id(water_temp_target_output).make_call();
-    water_temp_call.set_value(round(target));
-    water_temp_call.perform();
+    if (write_held(TEMP_NEW_TARGET))
+    {
+        // follow the target set on the remote until the hold expires
+        modbus_write_struct *write = write_slot(TEMP_NEW_TARGET);
+        input[TEMP_NEW_TARGET]->receive_value(write->value);
+        output(OUTPUT_DOEL_TEMP, write->value * 10);
+        return;
+    }
+    queue_write(TEMP_NEW_TARGET, round(target), [](bool confirmed)
+    {
+        if (!confirmed)
+            fsm.publish_info("Modbus target write failed");
+    });
     ESP_LOGD("set_target_temp", "Modbus target set to: %f", round(target));
-    id(doel_temp).publish_state(target * 10);
+    output(OUTPUT_DOEL_TEMP, target * 10);
+}
+// the same message twice in a row is published once
+void state_machine_class::publish_info(const char *message)
+{
+    output_text(OUTPUT_CONTROLLER_INFO, message);
+}
+//***************************************************************
+//*******************Modbus write queue**************************
+//***************************************************************
+// modbus_controller only queues the command, the write is confirmed when the polled value matches
+modbus_write_struct *state_machine_class::write_slot(input_types actuator)
+{
+    for (modbus_write_struct &write : writes)
+    {
+        if (write.actuator == actuator)
+            return &write;
+    }
+    return nullptr;
+}
+float state_machine_class::read_back(input_types actuator)
+{
+    if (actuator == TEMP_NEW_TARGET)
+        return sensors.water_temp_target_output;
+    return sensors.silent_mode_switch ? 1 : 0;
+}
+// returns false if the same value is already pending or confirmed, so callers can queue every cycle without stacking writes
+// a newer value replaces a queued one, the completion callback of the replaced write is not called
+bool state_machine_class::queue_write(input_types actuator, float value, std::function<void(bool)> on_complete)
+{
+    modbus_write_struct *write = write_slot(actuator);
+    if (write == nullptr)
+        return false;
+    if (write_held(actuator))
+    {
+        metrics_struct::add(metrics.modbus_writes_held);
+        return false;
+    }
+    if (write->value == value && (write->status == WRITE_PENDING || write->status == WRITE_CONFIRMED))
+    {
+        metrics_struct::add(metrics.modbus_writes_coalesced);
+        return false;
+    }
+    write->value = value;
+    write->status = WRITE_PENDING;
+    write->dispatched = false;
+    write->attempts = 0;
+    write->on_complete = on_complete;
+    return true;
+}
+void state_machine_class::dispatch_write(modbus_write_struct &write)
+{
+    if (write.actuator == TEMP_NEW_TARGET)
+    {
+        output(OUTPUT_WATER_TEMP_TARGET, write.value);
+    }
+    else if (write.value != 0)
+    {
+        output(OUTPUT_SILENT_MODE_SWITCH, 1);
+    }
+    else
+    {
+        output(OUTPUT_SILENT_MODE_SWITCH, 0);
+    }
+    transition_trace.actuator(get_run_time(), write.actuator, write.value);
+    write.dispatched = true;
+    write.issued_time = get_run_time();
+    write.attempts++;
+    int slot = &write - writes;
+    arm_timer((timer_ids)(TIMER_WRITE_SETTLE + slot), write.issued_time + (uint_fast32_t)write_settle_time);
+    arm_timer((timer_ids)(TIMER_WRITE_CONFIRM + slot), write.issued_time + (uint_fast32_t)write_confirm_time);
+}
+// dispatches queued writes and confirms or retries dispatched ones, returns true if a write was dispatched
+bool state_machine_class::process_write_queue()
+{
+    bool dispatched = false;
+    for (modbus_write_struct &write : writes)
+    {
+        if (write.status == WRITE_CONFIRMED)
+        {
+            // the polled register no longer matches what was confirmed: changed on the remote
+            float external_value = read_back(write.actuator);
+            if (!isnan(external_value) && external_value != write.value)
+            {
+                reconcile_override(write, external_value);
+                dispatched |= write.dispatched;
+            }
+            continue;
+        }
+        if (write.status != WRITE_PENDING)
+            continue;
+        if (!write.dispatched)
+        {
+            dispatch_write(write);
+            dispatched = true;
+            continue;
+        }
+        int slot = &write - writes;
+        if (timer_expired((timer_ids)(TIMER_WRITE_SETTLE + slot)) && read_back(write.actuator) == write.value)
+        {
+            write.status = WRITE_CONFIRMED;
+            if (write.on_complete)
+                write.on_complete(true);
+        }
+        else if (timer_expired((timer_ids)(TIMER_WRITE_CONFIRM + slot)))
+        {
+            if (write.attempts < write_max_attempts)
+            {
+                ESP_LOGW(state_name(), "Modbus write of %s not confirmed (read back %f, requested %f), retrying", input_type_names[write.actuator], read_back(write.actuator), write.value);
+                metrics_struct::add(metrics.modbus_write_retries);
+                dispatch_write(write);
+                dispatched = true;
+            }
+            else
+            {
+                ESP_LOGE(state_name(), "Modbus write of %s failed after %d attempts", input_type_names[write.actuator], write.attempts);
+                metrics_struct::add(metrics.modbus_write_failures);
+                write.status = WRITE_FAILED;
+                if (write.on_complete)
+                    write.on_complete(false);
+            }
+        }
+    }
+    return dispatched;
+}
+// the register values come from the regular modbus_controller poll, detecting an override costs no extra bus traffic
+void state_machine_class::reconcile_override(modbus_write_struct &write, float external_value)
+{
+    metrics_struct::add(metrics.external_overrides[write.actuator]);
+    if (override_policy == OVERRIDE_REASSERT)
+    {
+        ESP_LOGW(state_name(), "%s changed externally to %f, writing %f again", input_type_names[write.actuator], external_value, write.value);
+        metrics_struct::add(metrics.override_reasserts);
+        write.status = WRITE_PENDING;
+        write.attempts = 0;
+        dispatch_write(write);
+        return;
+    }
+    ESP_LOGW(state_name(), "%s changed externally to %f, adopting for %d seconds", input_type_names[write.actuator], external_value, override_hold_time);
+    publish_info("External override adopted");
+    write.value = external_value;
+    write.dispatched = false;
+    write.hold_until = get_run_time() + override_hold_time;
+    if (write.actuator == TEMP_NEW_TARGET)
+    {
+        input[TEMP_NEW_TARGET]->receive_value(external_value);
+        output(OUTPUT_DOEL_TEMP, external_value * 10);
+    }
+    else
+    {
+        output(OUTPUT_SILENT_MODE_STATE, external_value != 0 ? 1 : 0);
+        input[SILENT_MODE]->receive_state(external_value != 0);
+    }
+}
+bool state_machine_class::write_held(input_types actuator)
+{
+    modbus_write_struct *write = write_slot(actuator);
+    return write != nullptr && write->hold_until > get_run_time();
+}
+write_status state_machine_class::get_write_status(input_types actuator)
+{
+    modbus_write_struct *write = write_slot(actuator);
+    return write == nullptr ? WRITE_IDLE : write->status;
+}
+//***************************************************************
+//*******************Actuator invariants*************************
+//***************************************************************
+// heat(), external_pump() and backup_heat() enforce the interlocks, this catches anything that bypasses them
+// checks the real relay states and forces the safe side: pump on for heat, backup heat off
+void state_machine_class::check_actuator_invariants()
+{
+    if (sensors.relay_heat && !sensors.relay_pump)
+    {
+        metrics_struct::add(metrics.invariant_violations);
+        ESP_LOGE(state_name(), "Invariant violated: relay_heat on without relay_pump");
+        publish_info("ERROR: heat on without pump, pump on");
+        external_pump(true);
+    }
+    if (sensors.relay_backup_heat && (!sensors.relay_heat || !sensors.relay_pump))
+    {
+        metrics_struct::add(metrics.invariant_violations);
+        ESP_LOGE(state_name(), "Invariant violated: relay_backup_heat on without relay_heat or relay_pump");
+        publish_info("ERROR: backup_heat on without heat/pump, backup_heat off");
+        backup_heat(false);
+    }
+}
+//***************************************************************
+//*******************Cycle watchdog******************************
+//***************************************************************
+void state_machine_class::check_cycle_watchdog(uint32_t cycle_start_ms, uint32_t cycle_us)
+{
+    // missed period: this cycle started more than 50% late, run_time (fixed dt) is behind the real time
+    if (last_cycle_ms != 0 && (cycle_start_ms - last_cycle_ms) > cycle_period_ms + cycle_period_ms / 2)
+    {
+        metrics_struct::add(metrics.missed_periods);
+        ESP_LOGW(state_name(), "Watchdog: cycle started %u ms after previous cycle (period %u ms)", (unsigned)(cycle_start_ms - last_cycle_ms), (unsigned)cycle_period_ms);
+        watchdog_safe_state("Watchdog: missed cycle period");
+    }
+    last_cycle_ms = cycle_start_ms;
+    // overrun: the cycle itself took longer than its budget (usually a blocking modbus write)
+    if (cycle_us > cycle_budget_us)
+    {
+        metrics_struct::add(metrics.cycle_overruns);
+        ESP_LOGW(state_name(), "Watchdog: cycle took %u us (budget %u us)", (unsigned)cycle_us, (unsigned)cycle_budget_us);
+        watchdog_safe_state("Watchdog: cycle overrun");
+    }
+}
+// a late or slow cycle means timers and inputs can not be trusted, switch off what can not be left unattended
+// relay_heat and the pump are left alone, the LG unit protects itself
+void state_machine_class::watchdog_safe_state(const char *reason)
+{
+    backup_heat(false);
+    boost(false);
+    publish_info(reason);
+}
+//***************************************************************
+//*******************Sensor and output handoff*******************
+//***************************************************************
+// The ESPHome components are not thread safe. They are only touched on the ESPHome loop: the sensors are captured into
+// a snapshot and the outputs of the controller are applied from commands. Without LG_DUAL_CORE both happen inline.
+// With LG_DUAL_CORE the control cycle runs in its own task on the other core and both cross through an spsc ring
+#ifdef LG_DUAL_CORE
+static spsc_ring_struct<sensor_snapshot_struct, 2> snapshot_ring; // ESPHome loop -> control task
+static spsc_ring_struct<output_command_struct, 32> output_ring;   // control task -> ESPHome loop
+#ifdef ARDUINO_ARCH_ESP32
+static TaskHandle_t control_task_handle = nullptr;
+static void control_task(void *)
+{
+    sensor_snapshot_struct snapshot;
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (snapshot_ring.pop(snapshot))
+        {
+            fsm.sensors = snapshot;
+            fsm.control_cycle();
+        }
+    }
+}
+// the ESPHome loop runs on core 1, the control cycle gets core 0
+static void start_control_task()
+{
+    if (control_task_handle == nullptr)
+        xTaskCreatePinnedToCore(control_task, "lg_control", 8192, nullptr, 5, &control_task_handle, 0);
+}
+static void notify_control_task()
+{
+    xTaskNotifyGive(control_task_handle);
+}
+static void wait_for_output_ring()
+{
+    vTaskDelay(1);
+}
+#else
+// host builds: the same split on two threads, to measure the handoff latency and jitter
+static std::thread control_thread;
+static std::mutex control_mutex;
+static std::condition_variable control_wakeup;
+static bool control_pending = false;
+static bool control_stop = false;
+static std::atomic<uint32_t> control_cycles_done{0}; // the host tests wait for it before they apply the outputs
+static void control_task()
+{
+    sensor_snapshot_struct snapshot;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(control_mutex);
+            control_wakeup.wait(lock, []
+                                { return control_pending || control_stop; });
+            if (control_stop)
+                return;
+            control_pending = false;
+        }
+        while (snapshot_ring.pop(snapshot))
+        {
+            fsm.sensors = snapshot;
+            fsm.control_cycle();
+            control_cycles_done.fetch_add(1);
+        }
+    }
+}
+// the thread must be gone before the statics it uses are destroyed
+static void stop_control_task()
+{
+    {
+        std::lock_guard<std::mutex> lock(control_mutex);
+        control_stop = true;
+    }
+    control_wakeup.notify_one();
+    control_thread.join();
+}
+static void start_control_task()
+{
+    if (!control_thread.joinable())
+    {
+        control_thread = std::thread(control_task);
+        atexit(stop_control_task);
+    }
+}
+static void notify_control_task()
+{
+    {
+        std::lock_guard<std::mutex> lock(control_mutex);
+        control_pending = true;
+    }
+    control_wakeup.notify_one();
+}
+static void wait_for_output_ring()
+{
+    std::this_thread::yield();
+}
+#endif // ARDUINO_ARCH_ESP32
+#endif // LG_DUAL_CORE
+// called by the interval every cycle period, on the ESPHome loop
+void state_machine_class::run_cycle()
+{
+#ifdef LG_DUAL_CORE
+    sensor_snapshot_struct snapshot;
+    capture_sensors(snapshot);
+    start_control_task();
+    // the ring is full while the control task is still busy with older snapshots, this one is dropped
+    if (snapshot_ring.push(snapshot))
+        snapshot_delivered();
+    else
+        metrics_struct::add(metrics.snapshots_dropped);
+    notify_control_task();
+#else
+    capture_sensors(sensors);
+    snapshot_delivered();
+    control_cycle();
+#endif // LG_DUAL_CORE
+}
+// millis() of the last update per snapshot_sensors, ESPHome loop only. Ages are unsigned differences, they survive the
+// millis() wrap. A time that was never set is not an age, sensor_seen keeps it from looking fresh after a wrap
+static uint32_t sensor_updated_ms[SENSOR_COUNT] = {};
+static bool sensor_seen[SENSOR_COUNT] = {};
+static bool sensor_callbacks_registered = false;
+static void sensor_updated(snapshot_sensors sensor)
+{
+    sensor_updated_ms[sensor] = millis();
+    sensor_seen[sensor] = true;
+}
+// a binary sensor only calls back on a change, its modbus lambda reports every read that did not change it
+void state_machine_class::sensor_read(snapshot_sensors sensor)
+{
+    sensor_updated(sensor);
+}
+// call once on boot, before the first modbus poll. capture_sensors registers them if this was not done
+void state_machine_class::register_sensor_callbacks()
+{
+    if (sensor_callbacks_registered)
+        return;
+    sensor_callbacks_registered = true;
+    id(compressor_running).add_on_state_callback([](bool)
+                                                 { sensor_updated(SENSOR_COMPRESSOR_RUNNING); });
+    id(defrosting).add_on_state_callback([](bool)
+                                         { sensor_updated(SENSOR_DEFROSTING); });
+    id(sww_heating).add_on_state_callback([](bool)
+                                          { sensor_updated(SENSOR_SWW_HEATING); });
+    id(pump_running).add_on_state_callback([](bool)
+                                           { sensor_updated(SENSOR_PUMP_RUNNING); });
+    id(water_temp_aanvoer).add_on_state_callback([](float)
+                                                 { sensor_updated(SENSOR_WATER_TEMP_AANVOER); });
+    id(water_temp_retour).add_on_state_callback([](float)
+                                                { sensor_updated(SENSOR_WATER_TEMP_RETOUR); });
+    id(buiten_temp).add_on_state_callback([](float)
+                                          { sensor_updated(SENSOR_BUITEN_TEMP); });
+    id(compressor_hz).add_on_state_callback([](float)
+                                            { sensor_updated(SENSOR_COMPRESSOR_HZ); });
+    id(current_flow_rate).add_on_state_callback([](float)
+                                                { sensor_updated(SENSOR_CURRENT_FLOW_RATE); });
+}
+// read every entity the control cycle uses, on the ESPHome loop
+void state_machine_class::capture_sensors(sensor_snapshot_struct &snapshot)
+{
+    register_sensor_callbacks();
+    snapshot.captured_us = micros();
+    snapshot.captured_ms = millis();
+    const bool has_state[SENSOR_COUNT] = {id(compressor_running).has_state(), id(defrosting).has_state(), id(sww_heating).has_state(), id(pump_running).has_state(), id(water_temp_aanvoer).has_state(), id(water_temp_retour).has_state(), id(buiten_temp).has_state(), id(compressor_hz).has_state(), id(current_flow_rate).has_state()};
+    for (int i = 0; i < SENSOR_COUNT; i++)
+    {
+        snapshot.updated_ms[i] = sensor_updated_ms[i];
+        snapshot.valid[i] = has_state[i] && sensor_seen[i] && snapshot.captured_ms - sensor_updated_ms[i] <= sensor_max_age[i] * 1000;
+    }
+    snapshot.thermostat_signal = id(thermostat_signal).state;
+    for (int i = 0; i < zone_count; i++)
+        snapshot.zone_demand[i] = zones[i].demand();
+    snapshot.compressor_running = id(compressor_running).state;
+    snapshot.sww_heating = id(sww_heating).state;
+    snapshot.defrosting = id(defrosting).state;
+    snapshot.pump_running = id(pump_running).state;
+    snapshot.silent_mode_state = id(silent_mode_state).state;
+    snapshot.boost_switch = id(boost_switch).state;
+    snapshot.relay_backup_heat = id(relay_backup_heat).state;
+    snapshot.relay_pump = id(relay_pump).state;
+    snapshot.relay_heat = id(relay_heat).state;
+    snapshot.silent_mode_switch = id(silent_mode_switch).state;
+    snapshot.buiten_temp = id(buiten_temp).state;
+    snapshot.water_temp_aanvoer = id(water_temp_aanvoer).state;
+    snapshot.water_temp_retour = id(water_temp_retour).state;
+    snapshot.compressor_rpm = id(compressor_rpm).state;
+    snapshot.compressor_hz = id(compressor_hz).state;
+    snapshot.current_flow_rate = id(current_flow_rate).state;
+    const float values[SENSOR_COUNT - SENSOR_WATER_TEMP_AANVOER] = {snapshot.water_temp_aanvoer, snapshot.water_temp_retour, snapshot.buiten_temp, snapshot.compressor_hz, snapshot.current_flow_rate};
+    for (int i = SENSOR_WATER_TEMP_AANVOER; i < SENSOR_COUNT; i++)
+        snapshot.valid[i] = snapshot.valid[i] && !isnan(values[i - SENSOR_WATER_TEMP_AANVOER]);
+    snapshot.room_temp = room_temp_source ? room_temp_source() : id(binnen_temp).state;
+    snapshot.doel_temp = id(doel_temp).state;
+    snapshot.water_temp_target_output = id(water_temp_target_output).state;
+    snapshot.config_dirty = config_dirty;
+    if (config_dirty)
+        load_config(snapshot.config);
+    snapshot.stooklijn_dirty = stooklijn_dirty;
+}
+// the control cycle has the snapshot, the requests it carries are done. A dropped snapshot leaves them for the next one
+void state_machine_class::snapshot_delivered()
+{
+    config_dirty = false;
+    stooklijn_dirty = false;
+}
+static void apply_output(outputs target, float value, const char *text)
+{
+    switch (target)
+    {
+    case OUTPUT_RELAY_HEAT:
+        value != 0 ? id(relay_heat).turn_on() : id(relay_heat).turn_off();
+        break;
+    case OUTPUT_RELAY_PUMP:
+        value != 0 ? id(relay_pump).turn_on() : id(relay_pump).turn_off();
+        break;
+    case OUTPUT_RELAY_BACKUP_HEAT:
+        value != 0 ? id(relay_backup_heat).turn_on() : id(relay_backup_heat).turn_off();
+        break;
+    case OUTPUT_BOOST_SWITCH:
+        value != 0 ? id(boost_switch).turn_on() : id(boost_switch).turn_off();
+        break;
+    case OUTPUT_SILENT_MODE_SWITCH:
+        value != 0 ? id(silent_mode_switch).turn_on() : id(silent_mode_switch).turn_off();
+        break;
+    case OUTPUT_WATER_TEMP_TARGET:
+    {
+        uint32_t write_start = micros();
+        auto water_temp_call = id(water_temp_target_output).make_call();
+        water_temp_call.set_value(value);
+        water_temp_call.perform();
+        metrics.modbus_latency_us.observe(micros() - write_start);
+        break;
+    }
+    case OUTPUT_SILENT_MODE_STATE:
+        id(silent_mode_state).publish_state(value != 0);
+        break;
+    case OUTPUT_DOEL_TEMP:
+        id(doel_temp).publish_state(value);
+        break;
+    case OUTPUT_DERIVATIVE_VALUE:
+        id(derivative_value).publish_state(value);
+        break;
+    case OUTPUT_WATERTEMP_TARGET:
+        id(watertemp_target).publish_state(value);
+        break;
+    case OUTPUT_DEFROST_PREDICTION:
+        id(defrost_prediction).publish_state(value);
+        break;
+    case OUTPUT_ROOM_COMPENSATION_VALUE:
+        id(room_compensation_value).publish_state(value);
+        break;
+    case OUTPUT_BUILDING_HEAT_LOSS_VALUE:
+        id(building_heat_loss_value).publish_state(value);
+        break;
+    case OUTPUT_BUILDING_TIME_CONSTANT_VALUE:
+        id(building_time_constant_value).publish_state(value);
+        break;
+    case OUTPUT_CONTROLLER_STATE:
+        output_text_buffer.assign(text);
+        id(controller_state).publish_state(output_text_buffer);
+        break;
+    case OUTPUT_CONTROLLER_INFO:
+        output_text_buffer.assign(text);
+        id(controller_info).publish_state(output_text_buffer);
+        break;
+    case OUTPUT_THERMOSTAT_SIGNAL:
+        id(thermostat_signal).publish_state(value != 0);
+        break;
+    case OUTPUT_BUILDING_HEAT_LOSS:
+        id(building_heat_loss) = value;
+        break;
+    case OUTPUT_BUILDING_TIME_CONSTANT:
+        id(building_time_constant) = value;
+        break;
+    case OUTPUT_BUILDING_EMITTER_COEFFICIENT:
+        id(building_emitter_coefficient) = value;
+        break;
+    case OUTPUT_BUILDING_MODEL_SAMPLES:
+        id(building_model_samples) = (uint32_t)value;
+        break;
+    }
+}
+// switches update the snapshot, the rest of the cycle sees the state it switched to
+void state_machine_class::output(outputs target, float value)
+{
+    switch (target)
+    {
+    case OUTPUT_RELAY_HEAT:
+        sensors.relay_heat = value != 0;
+        break;
+    case OUTPUT_RELAY_PUMP:
+        sensors.relay_pump = value != 0;
+        break;
+    case OUTPUT_RELAY_BACKUP_HEAT:
+        sensors.relay_backup_heat = value != 0;
+        break;
+    case OUTPUT_BOOST_SWITCH:
+        sensors.boost_switch = value != 0;
+        break;
+    case OUTPUT_SILENT_MODE_SWITCH:
+        sensors.silent_mode_switch = value != 0;
+        break;
+    case OUTPUT_SILENT_MODE_STATE:
+        sensors.silent_mode_state = value != 0;
+        break;
+    case OUTPUT_DOEL_TEMP:
+        sensors.doel_temp = value;
+        break;
+    default:
+        break;
+    }
+    if (publish_unbatched || target <= OUTPUT_WATER_TEMP_TARGET || target > OUTPUT_CONTROLLER_INFO)
+    {
+        send_output(target, value, nullptr);
+        return;
+    }
+    // sensors are published by flush_publishes, the last value of the cycle wins
+    publish_slot_struct &slot = publish_slots[target];
+    if (slot.has_pending)
+        metrics_struct::add(metrics.publishes_suppressed);
+    slot.pending = value;
+    slot.has_pending = true;
+}
+void state_machine_class::output_text(outputs target, const char *text)
+{
+    if (!publish_unbatched && text_repeated(target, text))
+    {
+        metrics_struct::add(metrics.publishes_suppressed);
+        return;
+    }
+    metrics_struct::add(metrics.publishes);
+    send_output(target, 0, text);
+}
+void state_machine_class::send_output(outputs target, float value, const char *text)
+{
+#ifdef LG_DUAL_CORE
+    output_command_struct command;
+    command.output = target;
+    command.value = value;
+    command.captured_us = sensors.captured_us;
+    snprintf(command.text, sizeof(command.text), "%s", text != nullptr ? text : "");
+    // never drop an actuator command, the ESPHome loop drains the ring within a few ms
+    while (!output_ring.push(command))
+        wait_for_output_ring();
+#else
+    apply_output(target, value, text);
+#endif // LG_DUAL_CORE
+}
+// fnv-1a, texts are compared by hash so a slot does not keep copies of them
+static uint32_t text_hash(const char *text)
+{
+    uint32_t hash = 2166136261u;
+    for (; *text != 0; text++)
+        hash = (hash ^ (uint8_t)*text) * 16777619u;
+    return hash;
+}
+// a text is never sent twice in a row, a message that comes back after another one is sent again
+bool state_machine_class::text_repeated(outputs target, const char *text)
+{
+    publish_slot_struct &slot = publish_slots[target];
+    uint32_t hash = text_hash(text);
+    if (slot.has_published && slot.published_hash == hash)
+        return true;
+    slot.published_hash = hash;
+    slot.has_published = true;
+    return false;
+}
+// the publishes of a cycle go out together at its end, changes within the deadband are dropped
+// and a value that comes before the min_interval waits for a later flush
+void state_machine_class::flush_publishes()
+{
+    for (int target = OUTPUT_SILENT_MODE_STATE; target < OUTPUT_CONTROLLER_STATE; target++)
+    {
+        publish_slot_struct &slot = publish_slots[target];
+        const publish_policy_struct &policy = publish_policies[target];
+        if (!slot.has_pending)
+            continue;
+        if (slot.has_published && ((isnan(slot.pending) && isnan(slot.published)) || slot.pending == slot.published || fabs(slot.pending - slot.published) < policy.deadband))
+        {
+            slot.has_pending = false;
+            metrics_struct::add(metrics.publishes_suppressed);
+            continue;
+        }
+        if (slot.has_published && get_run_time() - slot.published_time < policy.min_interval)
+            continue;
+        send_output((outputs)target, slot.pending, nullptr);
+        metrics_struct::add(metrics.publishes);
+        slot.published = slot.pending;
+        slot.published_time = get_run_time();
+        slot.has_published = true;
+        slot.has_pending = false;
+    }
+}
+// called from a short interval on the ESPHome loop, applies the commands of the control task (LG_DUAL_CORE only)
+void state_machine_class::apply_outputs()
+{
+#ifdef LG_DUAL_CORE
+    output_command_struct command;
+    while (output_ring.pop(command))
+    {
+        apply_output(command.output, command.value, command.text);
+        metrics.handoff_latency_us.observe(micros() - command.captured_us);
+    }
+#endif // LG_DUAL_CORE
+}
+//***************************************************************
+//*******************Web server**********************************
+//***************************************************************
+#ifdef USE_WEB_SERVER
+// serves /metrics and /trace from the web_server task, only reads metrics and transition_trace
+class metrics_web_handler : public AsyncWebHandler
+{
+public:
+    bool canHandle(AsyncWebServerRequest *request) override
+    {
+        return request->method() == HTTP_GET && (request->url() == "/metrics" || request->url() == "/trace");
+    }
+    void handleRequest(AsyncWebServerRequest *request) override
+    {
+        std::string out;
+        if (request->url() == "/trace")
+        {
+            transition_trace.print(out);
+            request->send(200, "text/csv", out.c_str());
+            return;
+        }
+        metrics.print(out);
+        request->send(200, "text/plain; version=0.0.4", out.c_str());
+    }
+};
+#endif // USE_WEB_SERVER
+// call once after the web server is set up (on_boot)
+void state_machine_class::register_web_handlers()
+{
+#ifdef USE_WEB_SERVER
+    esphome::web_server_base::global_web_server_base->add_handler(new metrics_web_handler());
+#endif // USE_WEB_SERVER
 }
-
-static state_machine_class fsm;
\ No newline at end of file
@@ -4,10 +4,18 @@
 #include <Arduino.h>
 #endif // ARDUINO
 
+#include <atomic>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <string>
 #include <vector>
+#if defined(LG_DUAL_CORE) && !defined(ARDUINO_ARCH_ESP32)
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif // LG_DUAL_CORE
 
 enum states
 {
@@ -50,15 +58,474 @@ struct input_struct
   bool prev_state = false;
   float value = 0.0;
   float prev_value = 0.0;
-  uint_fast32_t input_change_time;
-  uint_fast32_t *run_time;
-  input_struct(uint_fast32_t *run_time_pointer);
+  uint_fast32_t input_change_time = 0;
+  uint_fast32_t *run_time = nullptr;
+  input_struct(uint_fast32_t *run_time_pointer = nullptr);
   void receive_state(bool new_state);
   void receive_value(float new_value);
   uint_fast32_t seconds_since_change();
   bool has_flag();
   void unflag();
 };
+// the inputs by value with the run_time they refer to, copies point to their own run_time
+// indexed like the old pointer list so input[THERMOSTAT]->state still works
+struct input_table_struct
+{
+  uint_fast32_t run_time = 0; // total esp boot time
+  input_struct inputs[16];
+  input_table_struct();
+  input_table_struct(const input_table_struct &other);
+  input_table_struct &operator=(const input_table_struct &other);
+  input_struct *operator[](int index) { return &inputs[index]; }
+};
+// last tracking values, one per cycle, without heap allocations
+struct derivative_ring_struct
+{
+  static const int size = 31; // 15 minutes
+  float values[size] = {0};
+  int count = 0;              // number of values (at most size)
+  int head = 0;               // index of the next value
+  void push(float value);
+  float back(int age = 0);    // value of age cycles ago
+  void clear();
+};
+// full resolution signal of a modbus sensor, a read that jumps away from the two before it is replaced by their median
+struct signal_filter_struct
+{
+  float samples[3] = {NAN, NAN, NAN}; // last modbus reads, newest at head - 1
+  int count = 0;                      // number of samples (at most 3)
+  int head = 0;                       // index of the next sample
+  uint32_t sample_ms = 0;             // update time of the newest sample
+  float value = NAN;                  // filtered value
+  float outlier_limit = 5;            // degrees a read may differ from the median before it is an outlier
+  bool rejected = false;              // the read of the last update was an outlier
+  float update(float sample, uint32_t updated_ms);
+};
+// demand input of one heating zone, see add_zone()
+struct zone_struct
+{
+  std::function<bool()> demand;  // raw demand of the zone (room thermostat, valve end switch)
+  float weight = 1;              // share of the total demand, e.g. the emitter power of the zone
+  uint_fast32_t on_delay = 0;    // seconds the raw demand must be on before the zone counts
+  uint_fast32_t off_delay = 0;   // seconds the raw demand must be off before the zone stops counting
+  bool raw = false;              // raw demand at the last update
+  bool active = false;           // demand after the delays, see TIMER_ZONE
+};
+// snapshot of the template numbers, rebuilt when a number changes. Defaults are the initial values in base.yml
+struct config_struct
+{
+  float stooklijn_min_oat = -18;
+  float stooklijn_max_oat = 16;
+  float stooklijn_max_wtemp = 35;
+  float stooklijn_min_wtemp = 25;
+  float wp_stooklijn_offset = 0;
+  float stooklijn_curve = 0;
+  float minimum_run_time = 30;              // minutes
+  float external_pump_runover = 10;         // minutes
+  float oat_silent_always_off = 2;
+  float oat_silent_always_on = 6;
+  float backup_heater_always_on_temp = -6;
+  float backup_heater_active_temp = -10;
+  float thermostat_off_delay = 1;           // minutes
+  float thermostat_on_delay = 0;            // minutes
+  float boost_time = 60;                    // minutes
+  float room_temp_target = 20;              // room temperature for the room compensation
+  bool validate();
+};
+// learns how much compressor work (run seconds weighted by compressor_hz) the outdoor unit does between two defrosts per OAT bucket
+struct defrost_predictor_struct
+{
+  static const int bucket_count = 8;       // OAT buckets of 2.5 degrees between -12.5 and +7.5 (outside this range no prediction)
+  float learned_load[bucket_count] = {0};  // learned frost load at start of defrost per bucket (0 = not learned yet)
+  float load = 0;                          // frost load accumulated since last defrost
+  float load_rate = 0;                     // frost load added per second at current conditions
+  bool load_valid = false;                 // true if load was accumulated from the end of a defrost (not from boot)
+  uint_fast32_t last_update_time = 0;      // run_time of last update
+  int_fast32_t predicted_seconds = -1;     // seconds until predicted defrost, -1 if no prediction
+  uint_fast32_t predicted_time = 0;        // run_time of predicted defrost when the preheat window was entered (0 = not in window)
+  uint_fast32_t defrost_count = 0;         // number of defrosts seen
+  uint_fast32_t predicted_count = 0;       // number of defrosts that were predicted (preheat window entered)
+  float mean_abs_error = 0;                // moving average of absolute prediction error in seconds
+  int bucket(float oat);
+  void update(uint_fast32_t run_time, bool compressor, bool defrost, float oat, float compressor_hz, uint_fast32_t window);
+  void defrost_start(uint_fast32_t run_time, float oat);
+  void defrost_end();
+};
+// online fit of a first order building model with recursive least squares, O(1) per sample
+// room:     d(room)/dt = a * (oat - room) + b * heat    heat loss H = a / b (kW/K), time constant tau = 1 / a (h)
+// emitters: heat = k * (mean water temp - room)         k in kW/K
+struct building_model_struct
+{
+  static const int sample_time = 60 * 60; // seconds per sample, the room temperature needs time to move a few tenths
+  static const int min_samples = 48;      // samples (two days) before the model is used
+  float forgetting = 0.99;                // forgetting factor per sample (memory of about 100 hours)
+  float theta[2] = {0.02, 0.1};           // a (1/h) and b (K/kWh), start at tau 50h and H 200 W/K
+  float P[2][2] = {{1, 0}, {0, 1}};       // covariance of theta
+  float k = 0.5;                          // emitter coefficient in kW/K
+  float k_P = 1;                          // covariance of k
+  uint32_t samples = 0;                   // samples since the model was reset
+  uint_fast32_t sample_start = 0;         // run_time at the start of the current sample
+  float prev_room = NAN;                  // averages of the previous sample
+  float prev_oat = 0;
+  float prev_heat = 0;
+  float heat_sum = 0;                     // sums over the current sample, averaged when it is complete
+  float oat_sum = 0;
+  float water_sum = 0;
+  float room_sum = 0;
+  uint32_t count = 0;
+  void update(uint_fast32_t run_time, float oat, float room, float supply, float retour, float flow);
+  void fit(float oat, float room, float emitter_room, float water, float heat, float emitter_heat, float room_change, float hours);
+  bool valid();
+  float heat_loss();     // W/K
+  float time_constant(); // hours
+  float supply_temp(float room_target, float oat);
+  void load(float heat_loss_value, float time_constant_value, float emitter_value, uint32_t sample_count);
+};
+// cause of a state transition, events from check_change_events use their input_types value
+enum transition_causes
+{
+  CAUSE_INIT_DONE = 16,
+  CAUSE_THERMOSTAT_ON,
+  CAUSE_START_DONE,
+  CAUSE_COMPRESSOR_ON,
+  CAUSE_STABILIZED,
+  CAUSE_BELOW_TARGET,
+  CAUSE_ABOVE_TARGET,
+  CAUSE_PREDICTED_OVERSHOOT,
+  CAUSE_PREDICTED_STALL,
+  CAUSE_OVERSHOOT_CONTAINED,
+  CAUSE_STALL_RECOVERED,
+  CAUSE_SWW_DONE,
+  CAUSE_DEFROST_DONE,
+  CAUSE_AFTERRUN_DONE,
+  CAUSE_UNKNOWN
+};
+struct transition_record_struct
+{
+  uint32_t run_time;      // run_time of the transition
+  uint32_t duration;      // seconds spent in the source state
+  uint8_t from;           // source state
+  uint8_t to;             // destination state
+  uint8_t cause;          // transition_causes or input_types of the event
+  uint16_t input_bits;    // input states, bit n is input_types n
+  float tracking_value;   // inputs at the moment of the transition
+  float stooklijn_target;
+  float pendel_target;
+  float oat;
+  float delta;
+};
+// ring with the last transitions, written by the control loop and read by the web server
+struct transition_trace_struct
+{
+  static const int size = 64;
+  transition_record_struct records[size];
+  std::atomic<uint32_t> sequences[size] = {}; // number + 1 of the record in the slot, 0 while add() writes it
+  std::atomic<uint32_t> count{0}; // total number of transitions, records[count % size] is the next to write
+  // FNV-1a over every transition and actuator write since boot: replays with the same inputs must end with the same digest
+  std::atomic<uint32_t> digest{2166136261u};
+  void add(const transition_record_struct &record);
+  void fold(uint32_t value);
+  void actuator(uint32_t run_time, input_types actuator, float value);
+  void print(std::string &out);
+};
+enum cycle_phases
+{
+  PHASE_RECEIVE_INPUTS,
+  PHASE_PROCESS_INPUTS,
+  PHASE_STATE,
+  PHASE_SET_TARGET,
+  PHASE_TRANSITION
+};
+enum write_status
+{
+  WRITE_IDLE,
+  WRITE_PENDING,
+  WRITE_CONFIRMED,
+  WRITE_FAILED
+};
+// minimum dwell and switch rate of a relay or coil. Safe direction switches (heat off, pump on, backup heat off) are never
+// delayed
+struct actuator_struct
+{
+  uint_fast32_t min_on_time = 0;      // seconds the output stays on before it may switch off
+  uint_fast32_t min_off_time = 0;     // seconds the output stays off before it may switch on
+  uint8_t max_switches_per_hour = 0;  // 0 = no limit
+  bool requested = false;             // last commanded state
+  bool pending = false;               // command delayed by dwell or rate limit, retried every cycle
+  bool switched_once = false;         // no dwell before the first switch after boot
+  uint_fast32_t last_switch_time = 0; // run_time of the last switch
+  uint_fast32_t window_start = 0;     // run_time at the start of the current hour for the rate limit
+  uint8_t window_switches = 0;        // switches in the current hour
+  bool allow(bool on, uint_fast32_t run_time);
+  void switched(uint_fast32_t run_time);
+};
+// what to do when the read back shows the LG remote changed a register the controller wrote
+enum override_policies
+{
+  OVERRIDE_ADOPT,   // follow the remote value and stop writing for override_hold_time
+  OVERRIDE_REASSERT // write the controller value again
+};
+// queued modbus write (holding register or coil), one slot per actuator so a newer value replaces a queued one
+struct modbus_write_struct
+{
+  input_types actuator;                  // TEMP_NEW_TARGET (holding register 2) or SILENT_MODE (coil 2)
+  float value = NAN;                     // requested value, coils use 0 and 1
+  write_status status = WRITE_IDLE;
+  bool dispatched = false;               // handed to the modbus controller, waiting for the read back
+  uint_fast32_t issued_time = 0;         // run_time of the last dispatch
+  uint8_t attempts = 0;                  // number of dispatches of this value
+  uint_fast32_t hold_until = 0;          // run_time until which writes are held after an adopted override
+  std::function<void(bool)> on_complete; // called with true when confirmed, false when failed
+};
+// result of resuming a timed state sequence
+enum sequence_results
+{
+  SEQUENCE_WAITING, // suspended on a deadline or an input
+  SEQUENCE_DONE     // ran to the end, the frame is released
+};
+class state_machine_class;
+struct sequence_frame_struct;
+typedef sequence_results (state_machine_class::*sequence_function)(sequence_frame_struct &frame);
+// continuation of a stackless sequence (see SEQUENCE_BEGIN). Holds only where to continue and what to wait for, so frames
+// come from a fixed pool in the state machine and are copied with fork()
+struct sequence_frame_struct
+{
+  bool active = false;
+  states owner = NONE;                 // state the sequence runs in, released when the state is left
+  sequence_function function = nullptr;
+  uint16_t resume_point = 0;           // line of the await to continue at, 0 = start
+  uint_fast32_t deadline = 0;          // run_time to resume at
+  int8_t wait_input = -1;              // input_types to resume on before the deadline (-1 = none)
+  bool wait_state = false;             // state of wait_input to resume on
+  bool poll = false;                   // resume every cycle to evaluate an await condition
+  void wait(uint_fast32_t until, int8_t input = -1, bool state = false, bool poll_condition = false);
+};
+// deadlines of the controller, fired by advance_timers in the first cycle that reaches them (up to one period late)
+enum timer_ids
+{
+  TIMER_THERMOSTAT_DELAY,  // thermostat_on_delay or thermostat_off_delay after a THERMOSTAT_SENSOR change
+  TIMER_MINIMUM_RUN,       // minimum_run_time after the start of the run
+  TIMER_BOOST,             // boost_time after boost was switched on
+  TIMER_BACKUP_HEAT_GUARD, // 15 minutes after a BACKUP_HEAT change before the low temperature trigger switches it on
+  TIMER_STATE_SETTLED,     // 5 minutes after a state change before RUN acts on the predictions
+  TIMER_RUN_MODULATION,    // 6 minutes after the start of the run, STABILIZE hands over to RUN when the compressor modulates
+  TIMER_RUN_SETTLED,       // 15 minutes after the start of the run, STABILIZE hands over to RUN on a flat derivative
+  TIMER_TARGET_HOLD,       // 5 minutes after a TEMP_NEW_TARGET change before STABILIZE moves it again
+  TIMER_BACKUP_DUTY_WINDOW, // end of the backup heat duty cycle window
+  TIMER_BACKUP_DUTY_ON,    // end of the on time within the duty cycle window
+  TIMER_WRITE_SETTLE,      // write_settle_time after a dispatch, one per writes slot (2)
+  TIMER_WRITE_CONFIRM = TIMER_WRITE_SETTLE + 2, // write_confirm_time after a dispatch, one per writes slot (2)
+  TIMER_ZONE = TIMER_WRITE_CONFIRM + 2,         // on_delay or off_delay after a raw demand change, one per zone (max_zones)
+  TIMER_COUNT = TIMER_ZONE + 8 // at most 32, the timers are kept as bit masks
+};
+enum profile_points
+{
+  PROFILE_RECEIVE_INPUTS,
+  PROFILE_THERMOSTAT_STATE,
+  PROFILE_CALCULATE_DERIVATIVE,
+  PROFILE_CALCULATE_STOOKLIJN,
+  PROFILE_CHECK_CHANGE_EVENTS
+};
+// cost of a hot path in profile_clock() ticks: CPU cycles on the ESP32, microseconds elsewhere
+struct profile_struct
+{
+  std::atomic<uint32_t> sum{0};
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint32_t> max_value{0};
+  void observe(uint32_t ticks);
+};
+// times the enclosing scope, also on early returns
+struct profile_scope_struct
+{
+  profile_struct &profile;
+  uint32_t start;
+  profile_scope_struct(profile_struct &target);
+  ~profile_scope_struct();
+};
+// fixed bucket histogram (value <= bound), last bucket is +Inf. Printed cumulative like prometheus
+struct histogram_struct
+{
+  static const int bucket_count = 9;
+  const uint32_t *bounds;                          // bucket_count - 1 upper bounds
+  std::atomic<uint32_t> buckets[bucket_count] = {}; // number of observations per bucket (not cumulative)
+  std::atomic<uint32_t> sum{0};
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint32_t> min_value{UINT32_MAX};
+  std::atomic<uint32_t> max_value{0};
+  histogram_struct(const uint32_t *bucket_bounds = nullptr);
+  void observe(uint32_t value);
+  uint32_t percentile(float fraction);
+};
+// lock-free handoff between one producer task and one consumer task, size must be a power of 2
+template <typename T, int size>
+struct spsc_ring_struct
+{
+  T items[size];
+  std::atomic<uint32_t> head{0}; // items pushed, only written by the producer
+  std::atomic<uint32_t> tail{0}; // items popped, only written by the consumer
+  bool push(const T &item)
+  {
+    uint32_t n = head.load(std::memory_order_relaxed);
+    if (n - tail.load(std::memory_order_acquire) >= (uint32_t)size)
+      return false;
+    items[n & (size - 1)] = item;
+    // publish the item after it is written
+    head.store(n + 1, std::memory_order_release);
+    return true;
+  }
+  bool pop(T &item)
+  {
+    uint32_t n = tail.load(std::memory_order_relaxed);
+    if (n == head.load(std::memory_order_acquire))
+      return false;
+    item = items[n & (size - 1)];
+    // hand the slot back after it is read
+    tail.store(n + 1, std::memory_order_release);
+    return true;
+  }
+};
+// raw states of the ESPHome entities the controller reads, captured on the ESPHome loop at the start of a cycle.
+// The controller only reads this copy, its own outputs update it so a cycle sees what it switched
+// modbus entities of the snapshot with a tracked age
+enum snapshot_sensors
+{
+  SENSOR_COMPRESSOR_RUNNING,
+  SENSOR_DEFROSTING,
+  SENSOR_SWW_HEATING,
+  SENSOR_PUMP_RUNNING,
+  SENSOR_WATER_TEMP_AANVOER,
+  SENSOR_WATER_TEMP_RETOUR,
+  SENSOR_BUITEN_TEMP,
+  SENSOR_COMPRESSOR_HZ,
+  SENSOR_CURRENT_FLOW_RATE,
+  SENSOR_COUNT
+};
+struct sensor_snapshot_struct
+{
+  uint32_t captured_us = 0;         // micros() at capture
+  uint32_t captured_ms = 0;         // millis() at capture
+  uint32_t updated_ms[SENSOR_COUNT] = {}; // millis() of the last update per snapshot_sensors
+  bool valid[SENSOR_COUNT] = {};    // has a state, not nan and updated within sensor_max_age
+  bool thermostat_signal = false;
+  bool zone_demand[8] = {};         // raw demand per zone (state_machine_class::max_zones)
+  bool compressor_running = false;
+  bool sww_heating = false;
+  bool defrosting = false;
+  bool pump_running = false;
+  bool silent_mode_state = false;
+  bool boost_switch = false;
+  bool relay_backup_heat = false;
+  bool relay_pump = false;
+  bool relay_heat = false;
+  bool silent_mode_switch = false;
+  float buiten_temp = NAN;
+  float water_temp_aanvoer = NAN;
+  float water_temp_retour = NAN;
+  float compressor_rpm = NAN;
+  float compressor_hz = NAN;
+  float current_flow_rate = NAN;
+  float room_temp = NAN;            // room_temp_source or binnen_temp
+  float doel_temp = NAN;
+  float water_temp_target_output = NAN;
+  bool config_dirty = false;        // config was read from the template numbers
+  bool stooklijn_dirty = false;     // buiten_temp changed enough to recalculate the stooklijn (update_stooklijn)
+  config_struct config;
+};
+// ESPHome entities the controller writes, applied on the ESPHome loop
+enum outputs
+{
+  OUTPUT_RELAY_HEAT,
+  OUTPUT_RELAY_PUMP,
+  OUTPUT_RELAY_BACKUP_HEAT,
+  OUTPUT_BOOST_SWITCH,
+  OUTPUT_SILENT_MODE_SWITCH,
+  OUTPUT_WATER_TEMP_TARGET, // holding register 2
+  OUTPUT_SILENT_MODE_STATE,
+  OUTPUT_DOEL_TEMP,
+  OUTPUT_DERIVATIVE_VALUE,
+  OUTPUT_WATERTEMP_TARGET,
+  OUTPUT_DEFROST_PREDICTION,
+  OUTPUT_ROOM_COMPENSATION_VALUE,
+  OUTPUT_BUILDING_HEAT_LOSS_VALUE,
+  OUTPUT_BUILDING_TIME_CONSTANT_VALUE,
+  OUTPUT_CONTROLLER_STATE,
+  OUTPUT_CONTROLLER_INFO,
+  OUTPUT_THERMOSTAT_SIGNAL,            // combined zone demand, only with zones. Outputs from here on are applied directly
+  OUTPUT_BUILDING_HEAT_LOSS,           // restore_value globals of the building model
+  OUTPUT_BUILDING_TIME_CONSTANT,
+  OUTPUT_BUILDING_EMITTER_COEFFICIENT,
+  OUTPUT_BUILDING_MODEL_SAMPLES        // a float is exact up to 2^24 samples
+};
+// publishing of a Home Assistant entity, see publish_policies
+struct publish_policy_struct
+{
+  float deadband;             // smaller changes are not published (0 = every change)
+  uint_fast32_t min_interval; // seconds between publishes, a newer value waits for it (not used for texts)
+};
+// published and pending state of an entity
+struct publish_slot_struct
+{
+  float published = NAN;              // last value sent
+  float pending = NAN;                // last value of the cycle, sent by flush_publishes
+  bool has_published = false;
+  bool has_pending = false;
+  uint_fast32_t published_time = 0;   // run_time of the last publish
+  uint32_t published_hash = 0;        // text: hash of the last text sent
+};
+struct output_command_struct
+{
+  outputs output;
+  float value;          // switches use 0 and 1
+  uint32_t captured_us; // capture time of the snapshot the command was computed from
+  char text[96];        // text sensors
+};
+// preallocated counters, only updated with relaxed atomics from the control loop so scraping never blocks run_cycle
+struct metrics_struct
+{
+  std::atomic<uint32_t> state_seconds[13] = {};      // seconds spent per state
+  std::atomic<uint32_t> transitions[13][13] = {};    // state transitions [from][to]
+  std::atomic<uint32_t> events_fired[16] = {};       // events from check_change_events that acted, per input_types
+  std::atomic<uint32_t> actuator_writes[16] = {};    // actuator writes per input_types (RELAY_HEAT, EXTERNAL_PUMP, BACKUP_HEAT, BOOST, SILENT_MODE, TEMP_NEW_TARGET)
+  std::atomic<uint32_t> actuator_deferred[16] = {};  // switches delayed by the actuator dwell or rate limit, per input_types
+  std::atomic<uint32_t> backup_heat_seconds{0};      // seconds relay_backup_heat was on
+  std::atomic<uint32_t> modbus_read_errors{0};       // cycles with an invalid (nan) modbus temperature reading
+  std::atomic<uint32_t> stooklijn_recalculations{0}; // calls to calculate_stooklijn
+  histogram_struct cycle_time_us;                    // run_cycle execution time
+  histogram_struct modbus_latency_us;                // duration of modbus target writes
+  histogram_struct phase_time_us[5];                 // run_cycle execution time per cycle_phases
+  std::atomic<uint32_t> cycle_overruns{0};           // cycles that took longer than the cycle budget
+  std::atomic<uint32_t> missed_periods{0};           // cycles that started late (previous cycle missed its period)
+  std::atomic<uint32_t> invariant_violations{0};     // relay interlock violations found by check_actuator_invariants
+  std::atomic<uint32_t> cycle_allocations{0};        // heap allocations during run_cycle (host builds with LG_COUNT_ALLOCATIONS)
+  std::atomic<uint32_t> heap_shrink_bytes{0};        // free heap lost during run_cycle (ESP32)
+  std::atomic<uint32_t> allocating_cycles{0};        // cycles after INIT that allocated, should stay 0
+  std::atomic<uint32_t> heap_free{0};                // free heap at the end of the last cycle (ESP32)
+  profile_struct functions[5];                       // hot paths per profile_points
+  profile_struct state_cycles[13];                   // whole run_cycle per state at the start of the cycle
+  std::atomic<uint32_t> modbus_writes_coalesced{0};  // queued writes dropped because the value was already pending or confirmed
+  std::atomic<uint32_t> modbus_write_retries{0};     // writes dispatched again because the read back did not match
+  std::atomic<uint32_t> modbus_write_failures{0};    // writes that were not confirmed after write_max_attempts
+  std::atomic<uint32_t> modbus_writes_held{0};       // writes refused while an adopted override is held
+  std::atomic<uint32_t> external_overrides[16] = {}; // confirmed writes changed by the LG remote, per input_types (TEMP_NEW_TARGET, SILENT_MODE)
+  std::atomic<uint32_t> override_reasserts{0};       // overrides written back under OVERRIDE_REASSERT
+  std::atomic<uint32_t> sequence_resumes{0};         // sequence continuations entered, suspended sequences are not polled
+  std::atomic<uint32_t> sequence_pool_exhausted{0};  // sequences that could not start for lack of a free frame
+  std::atomic<uint32_t> timers_fired{0};             // controller deadlines fired
+  std::atomic<uint32_t> snapshots_dropped{0};        // snapshots not handed to the control task, it was still busy (LG_DUAL_CORE)
+  histogram_struct handoff_latency_us;               // snapshot capture to applied output (LG_DUAL_CORE)
+  std::atomic<uint32_t> signal_outliers[16] = {};    // modbus reads replaced by the median, per input_types (OAT, TRACKING_VALUE)
+  std::atomic<uint32_t> publishes{0};                // entity states sent to Home Assistant
+  std::atomic<uint32_t> publishes_suppressed{0};     // publishes dropped by the deadband, repeats or a newer value of the same cycle
+  std::atomic<uint32_t> stale_cycles{0};             // cycles refused because a sensor that decides transitions was stale
+  std::atomic<uint32_t> stale_refusals[SENSOR_COUNT] = {}; // refused cycles per stale snapshot_sensors
+  std::atomic<uint32_t> defrosts_predicted{0};       // defrosts that started inside the preheat window
+  std::atomic<uint32_t> defrosts_missed{0};          // defrosts that started without a prediction
+  std::atomic<uint32_t> defrost_prediction_error_s{0}; // moving average of the absolute prediction error in seconds
+  metrics_struct();
+  static void add(std::atomic<uint32_t> &counter, uint32_t n = 1);
+  uint32_t lap(cycle_phases phase, uint32_t start);
+  void print(std::string &out);
+};
 
 class state_machine_class
 {
@@ -66,17 +533,67 @@ private:
   states current_state = INIT;                 // current state the machine is in
   states prev_state = NONE;                    // previous state
   states next_state = NONE;                    // next state (in case of state change)
-  std::vector<input_types> events;             // vector with events to check
-  uint_fast32_t run_time_value = 0;            // total esp boot time
+  input_types events[16];                      // events to check
+  int event_count = 0;
   uint_fast32_t state_start_time = 0;          // run_time_value on last state change
   uint_fast32_t run_start_time = 0;            // run_time_value of start of heat run
+  uint8_t next_state_cause = CAUSE_UNKNOWN;    // cause of the requested transition (transition_causes or input_types)
   int current_boost_offset = 0;                // keep track of offset during boost mode. Will be 0 if boost is not active
-  std::vector<float> derivative;               // vector of floats to integrate derivative (used in control logic)
+  int current_defrost_offset = 0;              // keep track of offset during defrost preheat. Will be 0 if no defrost is predicted
+  uint32_t building_model_saved = 0;           // samples of the building model at the last save
+  int current_room_offset = 0;                 // room compensation applied to the stooklijn (rounded room_correction)
+  float room_correction = 0;                   // output of the room compensation PI in degrees
+  float prev_room_error = NAN;                 // room error of the previous update (nan = restart the PI)
+  bool defrost_heat_banked = false;            // preheat was active and the tracking value reached the stooklijn (without preheat) when defrost started
+  derivative_ring_struct derivative;           // tracking values to integrate derivative (used in control logic)
+  signal_filter_struct oat_filter;             // buiten_temp at full resolution
+  signal_filter_struct tracking_filter;        // water_temp_aanvoer at full resolution
   bool backup_heat_temp_limit_trigger = false; // if backup heat triggered due to low temperature (always on)?
+  bool backup_duty_active = false;             // backup heat is driven by the STALL duty cycle
+  uint_fast32_t backup_duty_on_time = 0;       // seconds on in the current window
   bool update_stooklijn_bool = true;
+  float prev_oat = 20; // last valid oat for the stooklijn, oat at minimum water temp (20/20) to prevent strange events on startup
+  bool config_dirty = true; // a template number changed, rebuild config on the next cycle (ESPHome loop only)
+  bool stooklijn_dirty = false; // update_stooklijn() was called (ESPHome loop only)
+  bool holding_stale = false;  // the previous cycle was refused on stale sensors
+  const char *silent_mode_reason = nullptr; // info of a silent mode switch that waits for the dwell, a string literal
+  void apply_config(const config_struct &new_config);
+  void output(outputs target, float value);
+  void output_text(outputs target, const char *text);
+  void send_output(outputs target, float value, const char *text);
+  publish_slot_struct publish_slots[OUTPUT_CONTROLLER_INFO + 1]; // Home Assistant entities, see publish_policies
+  bool text_repeated(outputs target, const char *text);
+  modbus_write_struct writes[2];               // write queue, TEMP_NEW_TARGET and SILENT_MODE
+  modbus_write_struct *write_slot(input_types actuator);
+  float read_back(input_types actuator);
+  void dispatch_write(modbus_write_struct &write);
+  void reconcile_override(modbus_write_struct &write, float external_value);
+  bool actuator_request(input_types actuator, bool on, bool current);
+  static const int max_sequences = 4;
+  sequence_frame_struct sequences[max_sequences]; // frame pool of the timed state sequences
+  sequence_results run_sequence(sequence_function function);
+  bool sequence_ready(const sequence_frame_struct &frame);
+  void release_sequences(states owner);
+  sequence_results start_sequence(sequence_frame_struct &frame);
+  sequence_results wait_sequence(sequence_frame_struct &frame);
+  sequence_results stall_sequence(sequence_frame_struct &frame);
+  sequence_results defrost_sequence(sequence_frame_struct &frame);
+  sequence_results afterrun_sequence(sequence_frame_struct &frame);
+  uint_fast32_t timer_deadlines[TIMER_COUNT] = {}; // run_time at which each armed timer fires
+  uint32_t armed_timers = 0;   // timer_ids waiting for their deadline
+  uint32_t expired_timers = 0; // timer_ids that fired since they were armed
+  void advance_timers();
+  void arm_timer(timer_ids timer, uint_fast32_t deadline);
+  void cancel_timer(timer_ids timer);
+  bool timer_expired(timer_ids timer);
+  void timer_fired(timer_ids timer);
+  void rearm_timers();
 
 public:
-  input_struct *input[16]; // list of all inputs
+  input_table_struct input; // list of all inputs
+  uint32_t version = 0;      // completed run_cycles, identifies a snapshot
+  uint32_t fork_of = 0;      // version this instance was forked from (0 = not a fork)
+  config_struct config;    // parameters, read these instead of the template numbers
   bool entry_done = false;
   // default values, change these if you want
   int boost_offset = 2;       // number of degrees to raise stooklijn in boost mode
@@ -90,14 +607,64 @@ public:
   float pred_20_delta_5 = 0;  // predicted delta in 20 minutes based on last 5 minute derivative
   float pred_20_delta_10 = 0; // predicted delta in 20 minutes based on last 10 minute derivative
   float pred_5_delta_5 = 0;   // predicted delta in 5 minutes based on last 5 minute derivative
+  int defrost_preheat_offset = 2;             // number of degrees to raise stooklijn ahead of a predicted defrost (0 disables preheat)
+  int defrost_preheat_window = 15 * 60;       // seconds before a predicted defrost to start the preheat
+  int defrost_recovery_time = 2 * 60;         // minimum seconds after defrost end before leaving DEFROST when heat was banked
+  defrost_predictor_struct defrost_predictor; // learns the defrost interval
+  uint32_t cycle_budget_us = 500000;          // maximum run_cycle execution time before the watchdog fires
+  uint32_t cycle_period_ms = 30000;           // run_cycle interval, watchdog fires if a cycle starts more than 50% late
+  uint32_t last_cycle_ms = 0;                 // millis() at start of previous cycle
+  int write_settle_time = 65;                 // seconds after a write before the read back is trusted (modbus update_interval is 60s)
+  int write_confirm_time = 150;               // seconds to wait for a matching read back before the write is retried
+  int write_max_attempts = 3;                 // dispatches before a write is marked failed
+  bool backup_duty_cycle = true;              // STALL drives backup heat with a time proportioning duty cycle instead of plain on
+  int backup_duty_window = 20 * 60;           // seconds per duty cycle window
+  int backup_duty_min_on = 3 * 60;            // shorter on times are skipped
+  int backup_duty_min_off = 5 * 60;           // shorter off times become full on (matches the BACKUP_HEAT dwell)
+  float backup_duty_gain = 0.25;              // duty per degree of predicted deficit in 30 minutes
+  bool room_compensation = false;             // correct the stooklijn with a PI on the room temperature
+  float room_kp = 2.0;                        // degrees water per degree room error
+  float room_ti = 2 * 3600;                   // integral time in seconds
+  float room_max_correction = 4;              // correction is limited to +/- this many degrees (anti-windup)
+  float room_max_rate = 1;                    // maximum change of the correction in degrees per hour
+  std::function<float()> room_temp_source;    // room temperature, defaults to binnen_temp. Set to use a thermostat side sensor
+  building_model_struct building_model;       // learned heat loss and time constant of the house, persisted in globals
+  bool building_model_stooklijn = false;      // use the building model for the stooklijn instead of Z and C once it is valid
+  static const int max_zones = 8;
+  zone_struct zones[max_zones];               // zone demand inputs, replace thermostat_signal when zone_count > 0
+  int zone_count = 0;
+  float zone_start_demand = 0.3;              // weighted fraction of the zones that must ask for heat to start a run
+  float zone_stop_demand = 0;                 // the run continues while the weighted fraction is above this
+  float zone_active_weight = 0;               // weight of the active zones, updated on zone changes only
+  float zone_total_weight = 0;
+  bool zone_demand = false;                   // combined demand, fed into THERMOSTAT_SENSOR
+  bool zone_demand_published = false;         // thermostat_signal has been set to zone_demand
+  actuator_struct actuators[16];              // dwell and rate limits per input_types (RELAY_HEAT, EXTERNAL_PUMP, BACKUP_HEAT, SILENT_MODE)
+  override_policies override_policy = OVERRIDE_ADOPT; // reaction to a register changed on the LG remote
+  int override_hold_time = 60 * 60;           // seconds an adopted override is left alone before the controller writes again
+  uint32_t sensor_max_age[SENSOR_COUNT];      // seconds without an update before a snapshot_sensors is stale
   state_machine_class();
-  ~state_machine_class();
+  state_machine_class fork() const;
+  void restore(const state_machine_class &snapshot);
+  sensor_snapshot_struct sensors; // entity states of the current cycle
   void run_cycle();
+  void control_cycle();
+  void process_state();
+  void capture_sensors(sensor_snapshot_struct &snapshot);
+  void snapshot_delivered();
+  void register_sensor_callbacks();
+  void sensor_read(snapshot_sensors sensor);
+  bool sensors_fresh();
+  void apply_outputs();
+  void flush_publishes();
   void update_stooklijn();
+  void update_config();
+  void load_config(config_struct &new_config);
+  void set_config(const config_struct &new_config);
   states state();
   states get_prev_state();
   states get_next_state();
-  void state_transition(states newstate);
+  void state_transition(states newstate, uint8_t cause = CAUSE_UNKNOWN);
   void handle_state_transition();
   const char *state_friendly_name(states stt = NONE);
   const char *state_name(states stt = NONE);
@@ -112,13 +679,21 @@ public:
   void unflag_input_values();
   float calculate_stooklijn();
   bool thermostat_state();
+  int add_zone(std::function<bool()> demand, float weight = 1, uint_fast32_t on_delay = 0, uint_fast32_t off_delay = 0);
+  bool update_zones();
   void calculate_derivative(float tracking_value);
   void heat(bool mode);
   void external_pump(bool mode);
   void backup_heat(bool mode, bool temp_limit_trigger = false);
+  void backup_heat_duty_cycle(float deficit);
   void boost(bool mode);
   void toggle_boost();
-  void silent_mode(bool mode);
+  void update_defrost_prediction();
+  void update_room_compensation(uint_fast32_t dt);
+  void update_building_model();
+  void load_building_model();
+  void silent_mode(bool mode, const char *reason = nullptr);
+  void apply_pending_actuators();
   void toggle_silent_mode();
   int get_target_offset();
   void set_new_target(float new_target);
@@ -128,4 +703,13 @@ public:
   bool compressor_modulation();
   bool check_low_temp_trigger();
   void set_target_temp(float target);
+  void publish_info(const char *message);
+  bool queue_write(input_types actuator, float value, std::function<void(bool)> on_complete = nullptr);
+  bool process_write_queue();
+  write_status get_write_status(input_types actuator);
+  bool write_held(input_types actuator);
+  void check_actuator_invariants();
+  void register_web_handlers();
+  void check_cycle_watchdog(uint32_t cycle_start_ms, uint32_t cycle_us);
+  void watchdog_safe_state(const char *reason);
 };
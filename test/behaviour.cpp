@@ -0,0 +1,407 @@
+// targeted checks of controller behaviour that the invariants of the fuzzer do not cover
+//   behaviour            run all checks
+//   behaviour NAME       run one check
+#include "host_controller.h"
+#include <random>
+
+static int failures = 0;
+#define CHECK(condition)                                                        \
+    do                                                                          \
+    {                                                                           \
+        if (!(condition))                                                       \
+        {                                                                       \
+            printf("  %s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+// minutes of the same step, 2 cycles per minute
+static void run_minutes(int minutes, const host_step_struct &step)
+{
+    for (int i = 0; i < minutes * 2; i++)
+        host_cycle(step);
+}
+// boot with heat demand and a running compressor until the controller is in RUN
+static host_step_struct heat_up()
+{
+    host_step_struct step;
+    step.thermostat = true;
+    step.supply = 28;
+    run_minutes(10, step);
+    step.compressor = true;
+    step.compressor_hz = 80;
+    for (int i = 0; i < 2 * 60 && fsm.state() != RUN; i++)
+        host_cycle(step);
+    return step;
+}
+
+// a modbus outage longer than the sensor age holds the state and the FSM decisions, the bookkeeping of the cycle keeps
+// running and the controller picks up again when the data is fresh
+static void check_stale_recovery()
+{
+    host_reset();
+    host_step_struct step = heat_up();
+    CHECK(fsm.state() == RUN);
+    uint32_t stale_before = metrics.stale_cycles.load();
+    // a compressor stop during the outage is not seen, the controller can not tell it from the last read
+    host_step_struct outage = step;
+    outage.modbus_down = true;
+    outage.compressor = false;
+    int held = 0;
+    for (int i = 0; i < 2 * 10; i++)
+    {
+        uint32_t version = fsm.version;
+        uint_fast32_t run_time = fsm.get_run_time();
+        host_cycle(outage);
+        held += host_cycle_held;
+        CHECK(fsm.state() == RUN);
+        // version, run_time and the timers move on every cycle, held or not
+        CHECK(fsm.version == version + 1);
+        CHECK(fsm.get_run_time() == run_time + 30);
+    }
+    // stale after 3 minutes without a read
+    CHECK(held >= 2 * 10 - 2 * 3 - 1);
+    CHECK(metrics.stale_cycles.load() - stale_before == (uint32_t)held);
+    CHECK(controller_info.state == "Sensor data stale, state and outputs held");
+    // the poll is back: the first cycle acts on the compressor stop
+    host_step_struct back = step;
+    back.compressor = false;
+    host_cycle(back);
+    CHECK(!host_cycle_held);
+    CHECK(metrics.stale_cycles.load() - stale_before == (uint32_t)held);
+    CHECK(fsm.state() == WAIT);
+    // the binary sensors are read every poll without changing, they stay fresh
+    host_step_struct steady = step;
+    run_minutes(2 * 60, steady);
+    CHECK(metrics.stale_cycles.load() - stale_before == (uint32_t)held);
+}
+// ages are unsigned differences, a run across the millis() wrap stays fresh
+static void check_stale_millis_wrap()
+{
+    host_reset();
+    host_ms = UINT32_MAX - 30 * 60 * 1000u;
+    heat_up();
+    run_minutes(60, host_step_struct());
+    CHECK(metrics.stale_cycles.load() == 0);
+}
+// the safe direction of an actuator is never held back by its dwell time: heat off right after heat on, and the backup
+// heat and boost off from the watchdog in the cycle that misses its period
+static void check_safe_writes_immediate()
+{
+    host_reset();
+    host_step_struct step;
+    step.supply = 24;
+    step.thermostat = true;
+    for (int i = 0; i < 2 * 5 && !relay_heat.state; i++)
+        host_cycle(step);
+    CHECK(relay_heat.state);
+    // well within the minimum on time of relay_heat
+    fsm.heat(false);
+    CHECK(!relay_heat.state);
+    CHECK(metrics.actuator_deferred[RELAY_HEAT].load() == 0);
+
+    host_reset();
+    step = host_step_struct();
+    step.oat = -12;
+    step.supply = 22;
+    step.thermostat = true;
+    run_minutes(10, step);
+    step.compressor = true;
+    step.compressor_hz = 80;
+    for (int i = 0; i < 2 * 120 && !relay_backup_heat.state; i++)
+        host_cycle(step);
+    CHECK(relay_backup_heat.state);
+    step.boost = true;
+    host_cycle(step);
+    step.boost = false;
+    host_cycle(step);
+    CHECK(boost_switch.state);
+    CHECK(relay_backup_heat.state);
+    uint32_t missed = metrics.missed_periods.load();
+    host_ms += 60000;
+    host_cycle(step);
+    CHECK(metrics.missed_periods.load() == missed + 1);
+    CHECK(!relay_backup_heat.state);
+    CHECK(!boost_switch.state);
+    CHECK(metrics.actuator_deferred[BACKUP_HEAT].load() == 0);
+}
+// a silent mode switch that waits for the dwell time publishes its info once, when it is written
+static void check_silent_mode_info_once()
+{
+    host_reset();
+    host_step_struct step;
+    step.oat = 8;
+    step.supply = 28;
+    step.thermostat = true;
+    for (int i = 0; i < 2 * 30 && !silent_mode_switch.state; i++)
+        host_cycle(step);
+    CHECK(silent_mode_switch.state);
+    // below oat_silent_always_off, the switch back waits for the minimum on time of silent mode
+    const std::string reason = "Switching silent mode off oat < oat_silent_always_off";
+    step.oat = 0;
+    uint32_t publishes = controller_info.publishes;
+    int pending = 0;
+    for (int i = 0; i < 2 * 15 && silent_mode_switch.state; i++)
+    {
+        host_cycle(step);
+        if (!silent_mode_switch.state)
+            break;
+        pending += fsm.actuators[SILENT_MODE].pending;
+        CHECK(controller_info.state != reason);
+    }
+    CHECK(pending > 2);
+    CHECK(!silent_mode_switch.state);
+    CHECK(controller_info.state == reason);
+    CHECK(controller_info.publishes == publishes + 1);
+}
+// silent mode switched off on the LG remote is adopted: the state follows the remote and is not read back as on, the
+// controller leaves it off for override_hold_time and switches it on again after
+static void check_silent_mode_override()
+{
+    host_reset();
+    host_step_struct step;
+    step.oat = 8;
+    step.supply = 28;
+    step.thermostat = true;
+    for (int i = 0; i < 2 * 30 && !silent_mode_switch.state; i++)
+        host_cycle(step);
+    CHECK(silent_mode_switch.state);
+    run_minutes(5, step);
+    CHECK(fsm.get_write_status(SILENT_MODE) == WRITE_CONFIRMED);
+    silent_mode_switch.state = false;
+    host_cycle(step);
+    CHECK(metrics.external_overrides[SILENT_MODE].load() == 1);
+    CHECK(controller_info.state == "External override adopted");
+    for (int i = 0; i < 2 * 50; i++)
+    {
+        host_cycle(step);
+        CHECK(!silent_mode_switch.state);
+        CHECK(!silent_mode_state.state);
+        CHECK(!fsm.input[SILENT_MODE]->state);
+    }
+    CHECK(metrics.external_overrides[SILENT_MODE].load() == 1);
+    run_minutes(15, step);
+    CHECK(silent_mode_switch.state);
+    CHECK(silent_mode_state.state);
+}
+// controller_info drops a message only when it repeats the previous one, two alternating messages are both shown every time
+static void check_info_alternating()
+{
+    host_reset();
+    run_minutes(5, host_step_struct());
+    uint32_t publishes = controller_info.publishes;
+    fsm.publish_info("first message");
+    fsm.publish_info("first message");
+    CHECK(controller_info.publishes == publishes + 1);
+    fsm.publish_info("second message");
+    fsm.publish_info("first message");
+    fsm.publish_info("second message");
+    CHECK(controller_info.publishes == publishes + 4);
+    CHECK(controller_info.state == "second message");
+}
+// two weeks of a simulated house, 300 W/K and 30 h (the model starts at 200 W/K and 50 h), with emitters of 0.8 kW/K. The
+// room is read at the 0.1 degree resolution of binnen_temp. Returns false when the model was valid with a heat loss more
+// than 10% off
+static bool simulate_house(building_model_struct &model, bool night_setback)
+{
+    const float heat_loss = 300, time_constant = 30, emitter = 0.8, supply = 35, flow = 20;
+    const float capacity = heat_loss / 1000 * time_constant; // kWh/K
+    const float flow_factor = 60 / (4.186 * flow);           // supply - retour per kW
+    float room = 19;
+    bool heating = false;
+    bool plausible = true;
+    for (uint_fast32_t run_time = 30; run_time <= 14 * 24 * 3600; run_time += 30)
+    {
+        float hours = run_time / 3600.0;
+        float oat = 2 + 5 * sin(hours / 24 * 2 * M_PI) + 3 * sin(hours / (5 * 24) * 2 * M_PI);
+        float hour_of_day = fmod(hours, 24);
+        float target = !night_setback || (hour_of_day >= 7 && hour_of_day < 22) ? 20 : 16;
+        if (room < target - 0.2)
+            heating = true;
+        else if (room > target + 0.3)
+            heating = false;
+        // emitters at the mean water temperature
+        float heat = heating ? emitter * (supply - room) / (1 + emitter * flow_factor / 2) : 0;
+        room += (heat - heat_loss / 1000 * (room - oat)) / capacity * (30 / 3600.0);
+        if (heating)
+            model.update(run_time, oat, round(room * 10) / 10, supply, supply - heat * flow_factor, flow);
+        else
+            model.update(run_time, oat, round(room * 10) / 10, room, room, 0);
+        if (model.valid() && fabs(model.heat_loss() - heat_loss) > heat_loss / 10)
+            plausible = false;
+    }
+    return plausible;
+}
+// the building model learns the house within 10%. The time constant needs the room to move, a night setback. With a
+// constant setpoint the heat follows the loss and only their ratio, the heat loss that supply_temp() uses, is known
+static void check_building_model_fit()
+{
+    building_model_struct model;
+    CHECK(simulate_house(model, true));
+    CHECK(model.valid());
+    CHECK(fabs(model.heat_loss() - 300) < 30);
+    CHECK(fabs(model.time_constant() - 30) < 3);
+    CHECK(fabs(model.k - 0.8) < 0.08);
+    building_model_struct steady;
+    CHECK(simulate_house(steady, false));
+}
+// two hours with hot water, a defrost and the end of the heat demand, the branch of check_fork_restore
+static void run_branch(host_step_struct step)
+{
+    run_minutes(20, step);
+    step.sww = true;
+    step.supply = 45;
+    run_minutes(15, step);
+    step.sww = false;
+    step.supply = 27;
+    run_minutes(20, step);
+    step.defrost = true;
+    step.supply = 18;
+    run_minutes(4, step);
+    step.defrost = false;
+    step.supply = 28;
+    run_minutes(30, step);
+    step.thermostat = false;
+    run_minutes(31, step);
+}
+// a fork is an independent copy: the controller restored from it replays a branch to the same transitions, outputs and
+// state, and running the branch does not touch the fork
+static void check_fork_restore()
+{
+    host_reset();
+    host_step_struct step = heat_up();
+    CHECK(fsm.state() == RUN);
+    host_snapshot_struct snapshot;
+    host_save(snapshot);
+    uint32_t digest = transition_trace.digest.load();
+    CHECK(snapshot.controller.fork_of == fsm.version);
+    // the inputs of the fork point into the fork, not into fsm
+    const char *begin = (const char *)&snapshot.controller;
+    const char *oat = (const char *)snapshot.controller.input[OAT];
+    CHECK(oat >= begin && oat < begin + sizeof(snapshot.controller));
+    CHECK(snapshot.controller.input[OAT]->run_time == &snapshot.controller.input.run_time);
+
+    run_branch(step);
+    states state = fsm.state();
+    uint32_t version = fsm.version;
+    uint_fast32_t run_time = fsm.get_run_time();
+    uint32_t branch_digest = transition_trace.digest.load();
+    bool switches[host_switch_count];
+    for (int i = 0; i < host_switch_count; i++)
+        switches[i] = host_switches[i]->state;
+    float target = water_temp_target_output.state;
+    CHECK(branch_digest != digest);
+    CHECK(snapshot.controller.version == snapshot.controller.fork_of);
+    CHECK(snapshot.controller.state() == RUN);
+
+    host_load(snapshot);
+    transition_trace.digest.store(digest);
+    run_branch(step);
+    CHECK(fsm.state() == state);
+    CHECK(fsm.version == version);
+    CHECK(fsm.get_run_time() == run_time);
+    CHECK(transition_trace.digest.load() == branch_digest);
+    for (int i = 0; i < host_switch_count; i++)
+        CHECK(host_switches[i]->state == switches[i]);
+    CHECK(water_temp_target_output.state == target);
+}
+// 200k random cycles (about 70 days) with outages, glitches and manual switching do not allocate after INIT. The stub text
+// sensors keep a std::string like ESPHome does, it grows to the longest message once: reserved up front here
+static void check_cycle_allocations()
+{
+#ifndef LG_COUNT_ALLOCATIONS
+    printf("  built without LG_COUNT_ALLOCATIONS\n");
+    failures++;
+#else
+    host_reset();
+    controller_info.state.reserve(sizeof(output_command_struct::text));
+    controller_state.state.reserve(sizeof(output_command_struct::text));
+    std::mt19937_64 random(44);
+    host_step_struct step;
+    int outage = 0;
+    for (int cycle = 0; cycle < 200000; cycle++)
+    {
+        if (random() % 50 == 0)
+            step.thermostat = !step.thermostat;
+        if (random() % 40 == 0)
+            step.compressor = !step.compressor;
+        if (random() % 200 == 0)
+            step.defrost = !step.defrost;
+        if (random() % 300 == 0)
+            step.sww = !step.sww;
+        step.boost = random() % 500 == 0;
+        step.meddle = random() % 20 == 0;
+        if (outage == 0 && random() % 400 == 0)
+            outage = 1 + random() % 12;
+        step.modbus_down = outage > 0;
+        if (outage > 0)
+            outage--;
+        step.oat = clamp(step.oat + ((int)(random() % 5) - 2) / 10.0f, -20.0f, 18.0f);
+        step.supply = clamp(step.supply + ((int)(random() % 21) - 10) / 10.0f, 15.0f, 50.0f);
+        step.compressor_hz = 20 + random() % 60;
+        host_cycle(step);
+    }
+    CHECK(metrics.allocating_cycles.load() == 0);
+    CHECK(metrics.cycle_allocations.load() == 0);
+#endif // LG_COUNT_ALLOCATIONS
+}
+// a day of heat demand, compressor starts, defrosts and hot water: batching, the deadbands and the intervals drop most of
+// the publishes to Home Assistant. That they do not change the control is the golden_unbatched test
+static void check_publish_suppression()
+{
+    host_reset();
+    for (int cycle = 0; cycle < 2 * 60 * 24; cycle++)
+    {
+        host_step_struct step;
+        step.thermostat = (cycle / 240) % 3 != 0;
+        step.compressor = step.thermostat && (cycle / 20) % 7 != 0;
+        step.defrost = cycle % 600 > 590;
+        step.sww = cycle % 900 > 880;
+        step.oat = -5 + (cycle % 200) / 20.0f;
+        step.supply = 25 + (cycle % 40) / 4.0f;
+        step.compressor_hz = 40 + cycle % 50;
+        host_cycle(step);
+    }
+    uint32_t published = metrics.publishes.load();
+    uint32_t suppressed = metrics.publishes_suppressed.load();
+    printf("  %u published, %u suppressed (%.0f%%)\n", (unsigned)published, (unsigned)suppressed, 100.0 * suppressed / (published + suppressed));
+    CHECK(published > 0);
+    CHECK(suppressed >= 4 * published);
+}
+
+struct check_struct
+{
+    const char *name;
+    void (*function)();
+};
+static const check_struct checks[] = {
+    {"stale_recovery", check_stale_recovery},
+    {"stale_millis_wrap", check_stale_millis_wrap},
+    {"safe_writes_immediate", check_safe_writes_immediate},
+    {"silent_mode_info_once", check_silent_mode_info_once},
+    {"silent_mode_override", check_silent_mode_override},
+    {"info_alternating", check_info_alternating},
+    {"building_model_fit", check_building_model_fit},
+    {"fork_restore", check_fork_restore},
+    {"cycle_allocations", check_cycle_allocations},
+    {"publish_suppression", check_publish_suppression},
+};
+int main(int argc, char **argv)
+{
+    int run = 0;
+    for (const check_struct &check : checks)
+    {
+        if (argc > 1 && strcmp(argv[1], check.name) != 0)
+            continue;
+        int before = failures;
+        check.function();
+        printf("%-24s %s\n", check.name, failures == before ? "ok" : "FAILED");
+        run++;
+    }
+    if (run == 0)
+    {
+        printf("unknown check %s\n", argv[1]);
+        return 2;
+    }
+    return failures == 0 ? 0 : 1;
+}
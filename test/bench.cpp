@@ -0,0 +1,192 @@
+// micro benchmark of the control hot paths: run_cycle per state, the functions profiled on the device (see profile_points)
+// and fork() and restore() of the controller. Reports wall time, instructions (perf_event, where the kernel allows it) and
+// heap allocations per call as JSON, compare two runs to find a regression
+//   bench [--calls N]     N calls per measurement (default 20000)
+// exits 1 when a path of the cycle allocated, the cycle must not touch the heap after INIT
+#include "host_controller.h"
+#include <chrono>
+#include <random>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// instructions retired in user space, -1 when perf_event is not available (containers, paranoid kernels)
+static int open_instruction_counter()
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+static int instruction_counter = -1;
+
+struct measurement_struct
+{
+    uint64_t calls = 0;
+    uint64_t ns = 0;
+    uint64_t instructions = 0;
+    uint64_t allocations = 0;
+};
+// times body only, setup runs before every call outside the measurement
+template <typename setup_type, typename body_type>
+static measurement_struct measure(int calls, setup_type setup, body_type body)
+{
+    measurement_struct result;
+    for (int i = 0; i < calls; i++)
+    {
+        setup();
+        uint64_t instructions = 0;
+        if (instruction_counter >= 0)
+        {
+            ioctl(instruction_counter, PERF_EVENT_IOC_RESET, 0);
+            ioctl(instruction_counter, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        uint32_t allocations = allocation_count();
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto end = std::chrono::steady_clock::now();
+        result.allocations += allocation_count() - allocations;
+        if (instruction_counter >= 0)
+        {
+            ioctl(instruction_counter, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(instruction_counter, &instructions, sizeof(instructions)) != (ssize_t)sizeof(instructions))
+                instructions = 0;
+        }
+        result.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        result.instructions += instructions;
+        result.calls++;
+    }
+    return result;
+}
+
+// snapshot before a cycle that starts in the state, with the step of that cycle
+struct state_point_struct
+{
+    bool found = false;
+    int cycles_in_state = 0;
+    host_snapshot_struct snapshot;
+    host_step_struct step;
+};
+static state_point_struct state_points[AFTERRUN + 1];
+
+// a random heating season without modbus outages, the third cycle of every state is kept
+static void collect_state_points()
+{
+    host_reset();
+    std::mt19937_64 random(43);
+    host_step_struct step;
+    for (int cycle = 0; cycle < 2 * 60 * 24 * 14; cycle++)
+    {
+        if (random() % 50 == 0)
+            step.thermostat = !step.thermostat;
+        if (random() % 40 == 0)
+            step.compressor = !step.compressor;
+        step.defrost = random() % 150 == 0 ? !step.defrost : step.defrost && random() % 8 != 0;
+        step.sww = random() % 300 == 0 ? !step.sww : step.sww && random() % 30 != 0;
+        step.boost = random() % 500 == 0;
+        step.oat = clamp(step.oat + ((int)(random() % 5) - 2) / 10.0f, -15.0f, 15.0f);
+        step.supply = clamp(step.supply + ((int)(random() % 21) - 10) / 10.0f, 18.0f, 45.0f);
+        step.compressor_hz = 20 + random() % 60;
+        state_point_struct &point = state_points[fsm.state()];
+        if (!point.found && ++point.cycles_in_state == 3)
+        {
+            point.found = true;
+            host_save(point.snapshot);
+            point.step = step;
+        }
+        host_cycle(step);
+    }
+}
+
+static void print_result(bool &first, const char *name, const char *state, const measurement_struct &result)
+{
+    printf("%s\n    {\"name\": \"%s\", ", first ? "" : ",", name);
+    first = false;
+    if (state != nullptr)
+        printf("\"state\": \"%s\", ", state);
+    printf("\"calls\": %llu, \"ns_per_call\": %.1f, ", (unsigned long long)result.calls, (double)result.ns / result.calls);
+    if (instruction_counter >= 0)
+        printf("\"instructions_per_call\": %.1f, ", (double)result.instructions / result.calls);
+    else
+        printf("\"instructions_per_call\": null, ");
+    printf("\"allocations_per_call\": %.3f}", (double)result.allocations / result.calls);
+}
+
+int main(int argc, char **argv)
+{
+    int calls = 20000;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--calls") == 0)
+            calls = atoi(argv[++i]);
+    }
+    if (calls <= 0)
+    {
+        printf("usage: bench [--calls N]\n");
+        return 2;
+    }
+    instruction_counter = open_instruction_counter();
+    collect_state_points();
+    bool first = true;
+    bool allocated = false;
+#ifdef LG_COUNT_ALLOCATIONS
+    printf("{\n  \"allocations_counted\": true,\n");
+#else
+    printf("{\n  \"allocations_counted\": false,\n");
+#endif // LG_COUNT_ALLOCATIONS
+    printf("  \"controller_bytes\": %zu,\n  \"results\": [", sizeof(state_machine_class));
+    // run_cycle from the same point every call, the poll of the cycle is set up outside the measurement
+    for (int state = INIT; state <= AFTERRUN; state++)
+    {
+        state_point_struct &point = state_points[state];
+        if (!point.found)
+            continue;
+        measurement_struct result = measure(
+            calls,
+            [&]
+            {
+                host_load(point.snapshot);
+                host_poll(point.step);
+            },
+            []
+            { fsm.run_cycle(); });
+        print_result(first, "run_cycle", fsm.state_name((states)state), result);
+        allocated |= state != INIT && result.allocations > 0;
+    }
+    // the profiled functions in the middle of a run, repeated on the same controller
+    states run_state = state_points[RUN].found ? RUN : IDLE;
+    host_load(state_points[run_state].snapshot);
+    host_poll(state_points[run_state].step);
+    fsm.run_cycle();
+    auto nothing = [] {};
+    struct function_struct
+    {
+        const char *name;
+        measurement_struct result;
+    } functions[] = {
+        {"receive_inputs", measure(calls, nothing, [] { fsm.receive_inputs(); })},
+        {"thermostat_state", measure(calls, nothing, [] { fsm.thermostat_state(); })},
+        {"calculate_derivative", measure(calls, nothing, [] { fsm.calculate_derivative(28.5); })},
+        {"calculate_stooklijn", measure(calls, nothing, [] { fsm.calculate_stooklijn(); })},
+        {"check_change_events", measure(calls, [] { fsm.start_events(); fsm.add_event(SWW_RUN); fsm.add_event(DEFROST_RUN); fsm.add_event(THERMOSTAT); fsm.add_event(RELAY_HEAT); fsm.add_event(COMPRESSOR); }, [] { fsm.check_change_events(); })},
+    };
+    for (const function_struct &function : functions)
+    {
+        print_result(first, function.name, fsm.state_name(run_state), function.result);
+        allocated |= function.result.allocations > 0;
+    }
+    // a snapshot of the controller, into a copy that already exists as the explorer and the fuzzer keep theirs
+    static state_machine_class copy = fsm.fork();
+    print_result(first, "fork", fsm.state_name(run_state), measure(calls, nothing, [] { copy = fsm.fork(); }));
+    print_result(first, "restore", fsm.state_name(run_state), measure(calls, nothing, [] { fsm.restore(copy); }));
+    printf("\n  ]\n}\n");
+    if (instruction_counter >= 0)
+        close(instruction_counter);
+    return allocated ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+#pragma once
+// host build of the controller: the parts of ESPHome the state machine uses, with a clock the tests advance themselves
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::isnan;
+using std::max;
+using std::min;
+
+template <class T, class L, class H>
+T clamp(T value, L low, H high)
+{
+    return value < low ? low : (value > high ? high : value);
+}
+
+// logging is off unless a test switches it on, the fuzzer runs millions of cycles
+inline bool host_log = false;
+#define ESP_LOGD(tag, ...)             \
+    do                                 \
+    {                                  \
+        if (host_log)                  \
+        {                              \
+            printf("[%s] ", tag);      \
+            printf(__VA_ARGS__);       \
+            printf("\n");              \
+        }                              \
+    } while (0)
+#define ESP_LOGI ESP_LOGD
+#define ESP_LOGW ESP_LOGD
+#define ESP_LOGE ESP_LOGD
+
+// millis() is the test clock, micros() follows it so cycle times are 0 and replays are deterministic
+inline uint32_t host_ms = 0;
+inline uint32_t millis()
+{
+    return host_ms;
+}
+inline uint32_t micros()
+{
+    return host_ms * 1000u;
+}
+
+struct host_number;
+struct host_number_call
+{
+    host_number *number;
+    float value = NAN;
+    void set_value(float new_value) { value = new_value; }
+    void perform();
+};
+// template number, a call sets the state like the modbus read back would
+struct host_number
+{
+    float state = NAN;
+    host_number_call make_call() { return host_number_call{this}; }
+};
+inline void host_number_call::perform()
+{
+    number->state = value;
+}
+struct host_sensor
+{
+    float state = NAN;
+    bool has = false;
+    std::vector<std::function<void(float)>> callbacks;
+    bool has_state() { return has; }
+    void add_on_state_callback(std::function<void(float)> callback) { callbacks.push_back(callback); }
+    void publish_state(float value)
+    {
+        state = value;
+        has = true;
+        for (auto &callback : callbacks)
+            callback(value);
+    }
+};
+// like ESPHome, a binary sensor only calls back when its state changes
+struct host_binary_sensor
+{
+    bool state = false;
+    bool has = false;
+    std::vector<std::function<void(bool)>> callbacks;
+    bool has_state() { return has; }
+    void add_on_state_callback(std::function<void(bool)> callback) { callbacks.push_back(callback); }
+    void publish_state(bool value)
+    {
+        bool changed = !has || value != state;
+        state = value;
+        has = true;
+        if (!changed)
+            return;
+        for (auto &callback : callbacks)
+            callback(value);
+    }
+};
+struct host_switch
+{
+    bool state = false;
+    void turn_on() { state = true; }
+    void turn_off() { state = false; }
+    void publish_state(bool value) { state = value; }
+};
+struct host_text_sensor
+{
+    std::string state;
+    uint32_t publishes = 0;
+    void publish_state(const std::string &value)
+    {
+        state = value;
+        publishes++;
+    }
+};
+struct host_interval
+{
+    uint32_t get_update_interval() { return 30000; }
+};
+
+// ESPHome resolves id() in the generated code, here it is a reference to the global
+template <typename T>
+T &id(T &entity)
+{
+    return entity;
+}
+
+// the entities of base.yml, defined in host_controller.h
+extern host_number backup_heater_active_temp, backup_heater_always_on_temp, boost_time, external_pump_runover, minimum_run_time, oat_silent_always_off, oat_silent_always_on, stooklijn_curve, stooklijn_max_oat, stooklijn_max_wtemp, stooklijn_min_oat, stooklijn_min_wtemp, thermostat_off_delay, thermostat_on_delay, water_temp_target_output, wp_stooklijn_offset, room_temp_target;
+extern host_sensor defrost_prediction, buiten_temp, compressor_rpm, compressor_hz, derivative_value, doel_temp, water_temp_aanvoer, water_temp_retour, watertemp_target, binnen_temp, current_flow_rate, room_compensation_value, building_heat_loss_value, building_time_constant_value;
+extern host_switch boost_switch, relay_backup_heat, relay_heat, relay_pump, silent_mode_switch;
+extern host_binary_sensor compressor_running, defrosting, pump_running, silent_mode_state, sww_heating, thermostat_signal;
+extern host_text_sensor controller_info, controller_state;
+extern host_interval state_machine;
+// globals with restore_value
+extern float building_heat_loss, building_time_constant, building_emitter_coefficient;
+extern uint32_t building_model_samples;
@@ -0,0 +1,455 @@
+// breadth first exploration of the controller over an abstracted state vector: FSM state, environment (thermostat,
+// compressor, defrost, SWW, modulation, supply and outside temperature levels), relays, pending actuator switches and
+// discretized timers. Every node is a real controller snapshot, the abstraction only decides which nodes are the same.
+// Each level is expanded on one process per core, new nodes are deduplicated in a compact open addressing hash set.
+// Reports invariant violations, states that are never reached, nodes that can not get back to IDLE (deadlocks) and nodes
+// with heat demand that can not get to a heating state whatever the heat pump does (stuck, like WAIT without a restart)
+//   explorer [--workers N] [--max-nodes N]   the full space is about 1.6 million abstract states
+#include "host_controller.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// supply temperature levels around the stooklijn targets of the outside levels (28 at 8, 32 at -8, 33 at -12)
+static const float supply_levels[] = {22, 28, 32, 38};
+static const int supply_level_count = sizeof(supply_levels) / sizeof(supply_levels[0]);
+static const float oat_levels[] = {8, -8, -12};
+static const int oat_level_count = sizeof(oat_levels) / sizeof(oat_levels[0]);
+
+struct environment_struct
+{
+    bool thermostat = false;
+    bool compressor = false;
+    bool defrost = false;
+    bool sww = false;
+    bool modulating = false; // compressor below the modulation rpm
+    uint8_t supply = 1;
+    uint8_t oat = 0;
+};
+enum actions
+{
+    ACTION_WAIT, // let time pass until the abstract state changes (at most max_wait_cycles)
+    ACTION_THERMOSTAT,
+    ACTION_COMPRESSOR,
+    ACTION_DEFROST,
+    ACTION_SWW,
+    ACTION_MODULATION,
+    ACTION_SUPPLY_UP,
+    ACTION_SUPPLY_DOWN,
+    ACTION_OAT,
+    ACTION_BOOST, // boost switched on from Home Assistant
+    ACTION_COUNT
+};
+static const char *const action_names[ACTION_COUNT] = {"wait", "thermostat", "compressor", "defrost", "sww", "modulation", "supply_up", "supply_down", "oat", "boost"};
+static const int max_wait_cycles = 2 * 60;
+
+struct explorer_node_struct
+{
+    host_snapshot_struct snapshot;
+    environment_struct environment;
+};
+// what is left of a node after its level: the abstract key and how it was first reached
+struct node_info_struct
+{
+    uint64_t key;
+    uint32_t parent;
+    uint8_t action;
+    uint16_t depth;
+    bool expanded;
+};
+struct edge_struct
+{
+    uint32_t from;
+    uint32_t to;
+    uint8_t action;
+};
+// result of one expansion, written by the worker processes into shared memory
+struct expansion_struct
+{
+    uint64_t key;
+    const char *violation; // string literal, the same address in every process after fork
+};
+
+static int bucket(uint_fast32_t seconds, const uint_fast32_t *bounds, int count)
+{
+    int i = 0;
+    while (i < count && seconds >= bounds[i])
+        i++;
+    return i;
+}
+// abstract state of the current fsm and entities
+static uint64_t abstract_key(const environment_struct &environment)
+{
+    static const uint_fast32_t state_bounds[] = {3 * 60, 6 * 60, 10 * 60, 15 * 60, 30 * 60};
+    static const uint_fast32_t boost_bounds[] = {30 * 60, 60 * 60};
+    uint64_t key = fsm.state();
+    int shift = 4;
+    auto add = [&](uint64_t value, int bits)
+    {
+        key |= value << shift;
+        shift += bits;
+    };
+    add(environment.thermostat, 1);
+    add(environment.compressor, 1);
+    add(environment.defrost, 1);
+    add(environment.sww, 1);
+    add(environment.modulating, 1);
+    add(environment.supply, 3);
+    add(environment.oat, 2);
+    add(relay_heat.state, 1);
+    add(relay_pump.state, 1);
+    add(relay_backup_heat.state, 1);
+    add(boost_switch.state, 1);
+    add(silent_mode_switch.state, 1);
+    add(fsm.input[THERMOSTAT]->state, 1);
+    for (input_types actuator : {RELAY_HEAT, EXTERNAL_PUMP, BACKUP_HEAT, SILENT_MODE})
+        add(fsm.actuators[actuator].pending, 1);
+    add(bucket(fsm.seconds_since_state_start(), state_bounds, 5), 3);
+    add(fsm.get_run_time() - fsm.get_run_start_time() >= (uint_fast32_t)(fsm.config.minimum_run_time * 60), 1);
+    add(boost_switch.state ? bucket(fsm.input[BOOST]->seconds_since_change(), boost_bounds, 2) : 0, 2);
+    int pendel = (int)clamp(fsm.input[TEMP_NEW_TARGET]->value - fsm.input[STOOKLIJN_TARGET]->value, -4.0f, 4.0f);
+    add(pendel + 4, 4);
+    return key;
+}
+static host_step_struct environment_step(const environment_struct &environment)
+{
+    host_step_struct step;
+    step.thermostat = environment.thermostat;
+    step.compressor = environment.compressor;
+    step.defrost = environment.defrost;
+    step.sww = environment.sww;
+    step.oat = oat_levels[environment.oat];
+    step.supply = supply_levels[environment.supply];
+    step.compressor_hz = environment.modulating ? 40 : 90;
+    return step;
+}
+// continue node with action, leaves the successor in fsm and the entities
+static const char *apply_action(const explorer_node_struct &node, actions action, environment_struct &environment)
+{
+    host_load(node.snapshot);
+    environment = node.environment;
+    bool boost = false;
+    switch (action)
+    {
+    case ACTION_WAIT:
+        break;
+    case ACTION_THERMOSTAT:
+        environment.thermostat = !environment.thermostat;
+        break;
+    case ACTION_COMPRESSOR:
+        environment.compressor = !environment.compressor;
+        break;
+    case ACTION_DEFROST:
+        environment.defrost = !environment.defrost;
+        break;
+    case ACTION_SWW:
+        environment.sww = !environment.sww;
+        break;
+    case ACTION_MODULATION:
+        environment.modulating = !environment.modulating;
+        break;
+    case ACTION_SUPPLY_UP:
+        environment.supply = min(environment.supply + 1, supply_level_count - 1);
+        break;
+    case ACTION_SUPPLY_DOWN:
+        environment.supply = environment.supply > 0 ? environment.supply - 1 : 0;
+        break;
+    case ACTION_OAT:
+        environment.oat = (environment.oat + 1) % oat_level_count;
+        break;
+    case ACTION_BOOST:
+        boost = true;
+        break;
+    case ACTION_COUNT:
+        break;
+    }
+    uint64_t start_key = abstract_key(environment);
+    for (int cycle = 0; cycle < (action == ACTION_WAIT ? max_wait_cycles : 1); cycle++)
+    {
+        host_step_struct step = environment_step(environment);
+        step.boost = boost && cycle == 0;
+        states state_before = fsm.state();
+        host_cycle(step);
+        const char *violation = host_check_invariants(state_before);
+        if (violation != nullptr)
+            return violation;
+        if (abstract_key(environment) != start_key)
+            break;
+    }
+    return nullptr;
+}
+
+// open addressing set of abstract keys with their node index, keys are never 0 (state bits are at least INIT)
+struct key_set_struct
+{
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> nodes;
+    size_t count = 0;
+    key_set_struct() : keys(1 << 16, 0), nodes(1 << 16, 0) {}
+    static size_t slot_of(uint64_t key, size_t mask)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        return key & mask;
+    }
+    // node of key, or -1
+    int64_t find(uint64_t key) const
+    {
+        size_t mask = keys.size() - 1;
+        for (size_t slot = slot_of(key, mask);; slot = (slot + 1) & mask)
+        {
+            if (keys[slot] == key)
+                return nodes[slot];
+            if (keys[slot] == 0)
+                return -1;
+        }
+    }
+    void insert(uint64_t key, uint32_t node)
+    {
+        if ((count + 1) * 2 > keys.size())
+        {
+            std::vector<uint64_t> old_keys;
+            std::vector<uint32_t> old_nodes;
+            old_keys.swap(keys);
+            old_nodes.swap(nodes);
+            keys.assign(old_keys.size() * 2, 0);
+            nodes.assign(old_keys.size() * 2, 0);
+            count = 0;
+            for (size_t i = 0; i < old_keys.size(); i++)
+            {
+                if (old_keys[i] != 0)
+                    insert(old_keys[i], old_nodes[i]);
+            }
+        }
+        size_t mask = keys.size() - 1;
+        size_t slot = slot_of(key, mask);
+        while (keys[slot] != 0)
+            slot = (slot + 1) & mask;
+        keys[slot] = key;
+        nodes[slot] = node;
+        count++;
+    }
+};
+
+static std::vector<node_info_struct> infos;
+static void print_path(uint32_t node)
+{
+    std::vector<uint32_t> path;
+    for (uint32_t n = node; n != 0; n = infos[n].parent)
+        path.push_back(n);
+    printf("   boot");
+    for (size_t i = path.size(); i-- > 0;)
+        printf(" -%s-> %s", action_names[infos[path[i]].action], fsm.state_name((states)(infos[path[i]].key & 0xf)));
+    printf("\n");
+}
+// nodes that reach a node of target through the allowed edges
+static std::vector<bool> reaches(const std::vector<edge_struct> &edges, const std::vector<bool> &target, bool (*allowed)(const edge_struct &))
+{
+    std::vector<std::vector<uint32_t>> incoming(infos.size());
+    for (const edge_struct &edge : edges)
+    {
+        if (allowed(edge))
+            incoming[edge.to].push_back(edge.from);
+    }
+    std::vector<bool> reached = target;
+    std::vector<uint32_t> queue;
+    for (uint32_t n = 0; n < infos.size(); n++)
+    {
+        // nodes that were not expanded (node limit) are not judged
+        if (!infos[n].expanded)
+            reached[n] = true;
+        if (reached[n])
+            queue.push_back(n);
+    }
+    while (!queue.empty())
+    {
+        uint32_t n = queue.back();
+        queue.pop_back();
+        for (uint32_t from : incoming[n])
+        {
+            if (!reached[from])
+            {
+                reached[from] = true;
+                queue.push_back(from);
+            }
+        }
+    }
+    return reached;
+}
+static bool any_edge(const edge_struct &)
+{
+    return true;
+}
+// the heat pump does its job: no thermostat changes and no new defrost or SWW run, everything else may happen
+static bool fair_edge(const edge_struct &edge)
+{
+    uint64_t key = infos[edge.from].key;
+    if (edge.action == ACTION_THERMOSTAT)
+        return false;
+    if (edge.action == ACTION_DEFROST)
+        return (key >> 6) & 1;
+    if (edge.action == ACTION_SWW)
+        return (key >> 7) & 1;
+    return true;
+}
+static int report(const char *title, const std::vector<bool> &bad)
+{
+    int count = 0;
+    for (uint32_t n = 0; n < infos.size(); n++)
+    {
+        if (!bad[n])
+            continue;
+        if (count < 5)
+        {
+            printf("%s: %s, shortest path:\n", title, fsm.state_name((states)(infos[n].key & 0xf)));
+            print_path(n);
+        }
+        count++;
+    }
+    if (count > 5)
+        printf("%s: %d more\n", title, count - 5);
+    return count;
+}
+int main(int argc, char **argv)
+{
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_nodes = 2000000;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--workers") == 0)
+            workers = atol(argv[++i]);
+        else if (strcmp(argv[i], "--max-nodes") == 0)
+            max_nodes = strtoul(argv[++i], nullptr, 10);
+    }
+    if (workers < 1)
+        workers = 1;
+    host_reset();
+    std::vector<explorer_node_struct> frontier(1);
+    host_save(frontier[0].snapshot);
+    std::vector<uint32_t> frontier_nodes = {0};
+    key_set_struct seen;
+    infos.push_back({abstract_key(frontier[0].environment), 0, ACTION_WAIT, 0, false});
+    seen.insert(infos[0].key, 0);
+    std::vector<edge_struct> edges;
+    int violations = 0;
+    int depth = 0;
+    while (!frontier.empty() && infos.size() < max_nodes)
+    {
+        // expand the level on all cores, the workers see the frontier through the memory they inherit
+        size_t count = frontier.size() * ACTION_COUNT;
+        expansion_struct *results = (expansion_struct *)mmap(nullptr, count * sizeof(expansion_struct), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (results == MAP_FAILED)
+            return 2;
+        std::vector<pid_t> children;
+        fflush(stdout);
+        for (long worker = 0; worker < workers; worker++)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                environment_struct environment;
+                for (size_t n = worker; n < frontier.size(); n += workers)
+                {
+                    for (int action = 0; action < ACTION_COUNT; action++)
+                    {
+                        expansion_struct &result = results[n * ACTION_COUNT + action];
+                        result.violation = apply_action(frontier[n], (actions)action, environment);
+                        result.key = abstract_key(environment);
+                    }
+                }
+                _exit(0);
+            }
+            children.push_back(pid);
+        }
+        bool workers_ok = true;
+        for (pid_t pid : children)
+        {
+            int status = 0;
+            waitpid(pid, &status, 0);
+            workers_ok &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        if (!workers_ok)
+        {
+            printf("worker failed\n");
+            return 2;
+        }
+        // merge in a fixed order so the node numbering does not depend on the number of workers
+        std::vector<explorer_node_struct> next;
+        std::vector<uint32_t> next_nodes;
+        for (size_t n = 0; n < frontier.size(); n++)
+        {
+            infos[frontier_nodes[n]].expanded = true;
+            for (int action = 0; action < ACTION_COUNT; action++)
+            {
+                const expansion_struct &result = results[n * ACTION_COUNT + action];
+                if (result.violation != nullptr)
+                {
+                    if (violations++ < 5)
+                    {
+                        printf("invariant violated: %s after %s from\n", result.violation, action_names[action]);
+                        print_path(frontier_nodes[n]);
+                    }
+                    continue;
+                }
+                int64_t found = seen.find(result.key);
+                if (found < 0)
+                {
+                    found = infos.size();
+                    infos.push_back({result.key, frontier_nodes[n], (uint8_t)action, (uint16_t)(depth + 1), false});
+                    seen.insert(result.key, found);
+                    // only new nodes are run again here to keep their snapshot
+                    next.emplace_back();
+                    apply_action(frontier[n], (actions)action, next.back().environment);
+                    host_save(next.back().snapshot);
+                    next_nodes.push_back(found);
+                }
+                edges.push_back({frontier_nodes[n], (uint32_t)found, (uint8_t)action});
+            }
+        }
+        munmap(results, count * sizeof(expansion_struct));
+        frontier.swap(next);
+        frontier_nodes.swap(next_nodes);
+        depth++;
+    }
+    bool complete = frontier.empty();
+    printf("%s after %d levels: %zu abstract states, %zu transitions, %ld workers\n", complete ? "complete" : "node limit reached", depth, infos.size(), edges.size(), workers);
+
+    int failures = violations;
+    // every state except NONE must be reachable
+    int state_nodes[AFTERRUN + 1] = {};
+    for (const node_info_struct &info : infos)
+        state_nodes[info.key & 0xf]++;
+    for (int state = INIT; state <= AFTERRUN; state++)
+    {
+        printf("  %-10s %d\n", fsm.state_name((states)state), state_nodes[state]);
+        if (complete && state_nodes[state] == 0)
+        {
+            printf("unreachable state: %s\n", fsm.state_name((states)state));
+            failures++;
+        }
+    }
+    // deadlock: IDLE can not be reached again, whatever happens
+    std::vector<bool> idle(infos.size());
+    for (uint32_t n = 0; n < infos.size(); n++)
+        idle[n] = (infos[n].key & 0xf) == IDLE;
+    std::vector<bool> home = reaches(edges, idle, any_edge);
+    std::vector<bool> deadlock(infos.size());
+    for (uint32_t n = 0; n < infos.size(); n++)
+        deadlock[n] = !home[n];
+    failures += report("deadlock", deadlock);
+    // stuck: the thermostat asks for heat, but no behaviour of a working heat pump leads to a heating state
+    std::vector<bool> heating(infos.size());
+    for (uint32_t n = 0; n < infos.size(); n++)
+    {
+        states state = (states)(infos[n].key & 0xf);
+        heating[n] = state == STABILIZE || state == RUN || state == OVERSHOOT || state == STALL;
+    }
+    std::vector<bool> can_heat = reaches(edges, heating, fair_edge);
+    std::vector<bool> stuck(infos.size());
+    for (uint32_t n = 0; n < infos.size(); n++)
+        stuck[n] = ((infos[n].key >> 4) & 1) && (infos[n].key & 0xf) != INIT && !can_heat[n];
+    failures += report("stuck with heat demand", stuck);
+    printf("%d problems\n", failures);
+    return failures == 0 ? 0 : 1;
+}
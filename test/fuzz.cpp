@@ -0,0 +1,292 @@
+// randomized safety check: random heat pump, thermostat and modbus behaviour through run_cycle on all cores. The actuator
+// invariants are checked after every cycle, a failing sequence is shrunk to a minimal reproduction
+//   fuzz [--seconds N] [--workers N] [--seed N]   run for N seconds on N processes (default 2 s, all cores)
+//   fuzz --self-test                              check the shrinker on a property that is meant to fail
+//   fuzz --replay FILE                            run a printed reproduction with logging on
+#include "host_controller.h"
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef std::vector<host_step_struct> sequence_type;
+typedef const char *(*property_function)(states state_before);
+
+struct failure_struct
+{
+    int cycle = -1;               // index of the failing step, -1 = passed
+    const char *message = nullptr;
+};
+
+// open loop: the steps do not depend on the controller, so a sequence replays and shrinks deterministically
+static sequence_type random_sequence(uint64_t seed)
+{
+    std::mt19937_64 random(seed);
+    sequence_type steps(200 + random() % 1800);
+    host_step_struct step;
+    int outage = 0;
+    for (host_step_struct &next : steps)
+    {
+        if (random() % 50 == 0)
+            step.thermostat = !step.thermostat;
+        if (random() % 40 == 0)
+            step.compressor = !step.compressor;
+        if (random() % 200 == 0)
+            step.defrost = !step.defrost;
+        if (random() % 300 == 0)
+            step.sww = !step.sww;
+        step.boost = random() % 500 == 0;
+        step.meddle = random() % 20 == 0;
+        if (outage == 0 && random() % 400 == 0)
+            outage = 1 + random() % 12;
+        step.modbus_down = outage > 0;
+        if (outage > 0)
+            outage--;
+        step.oat = clamp(step.oat + ((int)(random() % 5) - 2) / 10.0f, -20.0f, 18.0f);
+        step.supply = clamp(step.supply + ((int)(random() % 21) - 10) / 10.0f, 15.0f, 50.0f);
+        step.compressor_hz = 20 + random() % 60;
+        next = step;
+        // single glitched modbus read
+        if (random() % 300 == 0)
+            next.supply = 0;
+    }
+    return steps;
+}
+static failure_struct run(const sequence_type &steps, property_function property)
+{
+    host_reset();
+    failure_struct failure;
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        states state_before = fsm.state();
+        host_cycle(steps[i]);
+        const char *message = property(state_before);
+        if (message != nullptr)
+        {
+            failure.cycle = i;
+            failure.message = message;
+            return failure;
+        }
+    }
+    return failure;
+}
+static bool fails_same(const sequence_type &steps, property_function property, const char *message)
+{
+    failure_struct failure = run(steps, property);
+    return failure.message != nullptr && strcmp(failure.message, message) == 0;
+}
+// delta debugging: cut everything after the failure, drop chunks of steps while it still fails the same way, then
+// reset the fields of the remaining steps to their defaults
+static sequence_type shrink(sequence_type steps, property_function property, const char *message)
+{
+    bool progress = true;
+    while (progress)
+    {
+        progress = false;
+        failure_struct failure = run(steps, property);
+        steps.resize(failure.cycle + 1);
+        for (size_t chunk = steps.size() / 2; chunk >= 1; chunk /= 2)
+        {
+            for (size_t start = 0; start + chunk <= steps.size();)
+            {
+                sequence_type candidate = steps;
+                candidate.erase(candidate.begin() + start, candidate.begin() + start + chunk);
+                if (fails_same(candidate, property, message))
+                {
+                    steps = candidate;
+                    progress = true;
+                }
+                else
+                    start += chunk;
+            }
+        }
+        const host_step_struct plain;
+        for (host_step_struct &step : steps)
+        {
+            for (int field = 0; field < 10; field++)
+            {
+                host_step_struct saved = step;
+                switch (field)
+                {
+                case 0: step.thermostat = plain.thermostat; break;
+                case 1: step.compressor = plain.compressor; break;
+                case 2: step.defrost = plain.defrost; break;
+                case 3: step.sww = plain.sww; break;
+                case 4: step.boost = plain.boost; break;
+                case 5: step.meddle = plain.meddle; break;
+                case 6: step.modbus_down = plain.modbus_down; break;
+                case 7: step.oat = plain.oat; break;
+                case 8: step.supply = plain.supply; break;
+                case 9: step.compressor_hz = plain.compressor_hz; break;
+                }
+                if (memcmp(&saved, &step, sizeof(step)) == 0)
+                    continue;
+                if (fails_same(steps, property, message))
+                    progress = true;
+                else
+                    step = saved;
+            }
+        }
+    }
+    return steps;
+}
+// one step per line, fuzz --replay reads it back
+static void print_sequence(const sequence_type &steps)
+{
+    printf("# thermostat compressor defrost sww boost meddle modbus_down oat supply compressor_hz\n");
+    for (const host_step_struct &step : steps)
+        printf("%d %d %d %d %d %d %d %.1f %.1f %.0f\n", step.thermostat, step.compressor, step.defrost, step.sww, step.boost, step.meddle, step.modbus_down, step.oat, step.supply, step.compressor_hz);
+}
+static sequence_type read_sequence(const char *path)
+{
+    sequence_type steps;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        host_step_struct step;
+        int flags[7];
+        for (int &flag : flags)
+            fields >> flag;
+        fields >> step.oat >> step.supply >> step.compressor_hz;
+        step.thermostat = flags[0];
+        step.compressor = flags[1];
+        step.defrost = flags[2];
+        step.sww = flags[3];
+        step.boost = flags[4];
+        step.meddle = flags[5];
+        step.modbus_down = flags[6];
+        steps.push_back(step);
+    }
+    return steps;
+}
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+struct worker_result_struct
+{
+    uint64_t sequences = 0;
+    uint64_t cycles = 0;
+    uint64_t failures = 0;
+};
+// worker process: seeds first, first + stride, ... until the time is up. Shrinks and prints the first failure
+static worker_result_struct fuzz_worker(uint64_t first, uint64_t stride, double seconds)
+{
+    worker_result_struct result;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t seed = first; seconds_since(start) < seconds; seed += stride)
+    {
+        sequence_type steps = random_sequence(seed);
+        failure_struct failure = run(steps, host_check_invariants);
+        result.sequences++;
+        result.cycles += failure.cycle < 0 ? steps.size() : failure.cycle + 1;
+        if (failure.message == nullptr)
+            continue;
+        result.failures++;
+        sequence_type minimal = shrink(steps, host_check_invariants, failure.message);
+        printf("FAIL seed %llu: %s at cycle %d, shrunk from %zu to %zu steps:\n", (unsigned long long)seed, failure.message, failure.cycle, steps.size(), minimal.size());
+        print_sequence(minimal);
+        fflush(stdout);
+        break;
+    }
+    return result;
+}
+// meant to fail: reaching STABILIZE needs INIT, the start sequence and a compressor start, a handful of steps
+static const char *never_stabilize(states)
+{
+    return fsm.state() == STABILIZE ? "reached STABILIZE" : nullptr;
+}
+static int self_test()
+{
+    for (uint64_t seed = 1; seed < 1000; seed++)
+    {
+        sequence_type steps = random_sequence(seed);
+        failure_struct failure = run(steps, never_stabilize);
+        if (failure.message == nullptr)
+            continue;
+        sequence_type minimal = shrink(steps, never_stabilize, failure.message);
+        printf("self test: seed %llu fails at cycle %d, shrunk to %zu steps\n", (unsigned long long)seed, failure.cycle, minimal.size());
+        print_sequence(minimal);
+        // 3 INIT cycles, 6 start sequence cycles and the compressor start
+        if (!fails_same(minimal, never_stabilize, failure.message) || minimal.size() > 12)
+        {
+            printf("self test failed: the shrunk sequence does not reproduce or is not minimal\n");
+            return 1;
+        }
+        return 0;
+    }
+    printf("self test failed: no sequence reached STABILIZE\n");
+    return 1;
+}
+int main(int argc, char **argv)
+{
+    double seconds = 2;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t seed = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--self-test") == 0)
+            return self_test();
+        if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            host_log = true;
+            failure_struct failure = run(read_sequence(argv[++i]), host_check_invariants);
+            printf("%s\n", failure.message != nullptr ? failure.message : "passed");
+            return failure.message != nullptr;
+        }
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            workers = atol(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], nullptr, 10);
+    }
+    if (workers < 1)
+        workers = 1;
+    std::vector<int> pipes;
+    std::vector<pid_t> children;
+    auto start = std::chrono::steady_clock::now();
+    for (long worker = 0; worker < workers; worker++)
+    {
+        int fds[2];
+        if (pipe(fds) != 0)
+            return 2;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(fds[0]);
+            worker_result_struct result = fuzz_worker(seed + worker, workers, seconds);
+            ssize_t written = write(fds[1], &result, sizeof(result));
+            _exit(written == sizeof(result) ? 0 : 2);
+        }
+        close(fds[1]);
+        pipes.push_back(fds[0]);
+        children.push_back(pid);
+    }
+    worker_result_struct total;
+    bool ok = true;
+    for (size_t worker = 0; worker < children.size(); worker++)
+    {
+        worker_result_struct result;
+        if (read(pipes[worker], &result, sizeof(result)) != sizeof(result))
+            ok = false;
+        close(pipes[worker]);
+        int status = 0;
+        waitpid(children[worker], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ok = false;
+        total.sequences += result.sequences;
+        total.cycles += result.cycles;
+        total.failures += result.failures;
+    }
+    double elapsed = seconds_since(start);
+    printf("%ld workers, %.1f s: %llu sequences (%.0f per minute), %llu cycles (%.0f per second), %llu failures\n", workers, elapsed, (unsigned long long)total.sequences, total.sequences * 60 / elapsed, (unsigned long long)total.cycles, total.cycles / elapsed, (unsigned long long)total.failures);
+    return ok && total.failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,226 @@
+// golden traces: recorded scenarios replayed through run_cycle, the transition trace and the trace digest must match the
+// files in test/golden. Every scenario runs in its own process, a behaviour change shows as a diff of the transitions
+//   golden DIR              compare against DIR/<scenario>.txt
+//   golden DIR --update     write the current traces as the new golden files
+#include "host_controller.h"
+#include <fstream>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef std::vector<host_step_struct> sequence_type;
+
+// minutes of the same step, 2 cycles per minute
+static void hold(sequence_type &steps, int minutes, const host_step_struct &step)
+{
+    for (int i = 0; i < minutes * 2; i++)
+        steps.push_back(step);
+}
+// supply temperature moving linearly to to over minutes
+static void ramp(sequence_type &steps, int minutes, host_step_struct &step, float to)
+{
+    float from = step.supply;
+    for (int i = 1; i <= minutes * 2; i++)
+    {
+        step.supply = from + (to - from) * i / (minutes * 2);
+        steps.push_back(step);
+    }
+}
+// thermostat on in IDLE, pump and heat on, compressor start after 5 minutes, supply up to the stooklijn target
+static host_step_struct heat_up(sequence_type &steps, float oat)
+{
+    host_step_struct step;
+    step.oat = oat;
+    step.supply = 24;
+    hold(steps, 5, step);
+    step.thermostat = true;
+    hold(steps, 5, step);
+    step.compressor = true;
+    step.compressor_hz = 80;
+    ramp(steps, 20, step, 28);
+    hold(steps, 30, step);
+    return step;
+}
+static sequence_type cold_start()
+{
+    sequence_type steps;
+    heat_up(steps, 5);
+    return steps;
+}
+// hot water request in RUN, back to heating afterwards
+static sequence_type sww_during_run()
+{
+    sequence_type steps;
+    host_step_struct step = heat_up(steps, 5);
+    step.sww = true;
+    step.supply = 45;
+    hold(steps, 20, step);
+    step.sww = false;
+    step.supply = 26;
+    ramp(steps, 15, step, 28);
+    hold(steps, 20, step);
+    return steps;
+}
+// cold outside, the supply stays below the stooklijn target (STALL), then a defrost
+static sequence_type defrost_during_stall()
+{
+    sequence_type steps;
+    host_step_struct step = heat_up(steps, -8);
+    hold(steps, 30, step);
+    step.defrost = true;
+    step.supply = 18;
+    hold(steps, 4, step);
+    step.defrost = false;
+    ramp(steps, 10, step, 28);
+    hold(steps, 30, step);
+    return steps;
+}
+// the thermostat is satisfied before the minimum run time
+static sequence_type thermostat_off_in_minimum_run()
+{
+    sequence_type steps;
+    host_step_struct step;
+    step.supply = 24;
+    hold(steps, 5, step);
+    step.thermostat = true;
+    hold(steps, 5, step);
+    step.compressor = true;
+    step.compressor_hz = 80;
+    ramp(steps, 10, step, 28);
+    step.thermostat = false;
+    hold(steps, 30, step);
+    step.compressor = false;
+    hold(steps, 15, step);
+    return steps;
+}
+// boost from Home Assistant in RUN, runs out after boost_time
+static sequence_type boost_expiry()
+{
+    sequence_type steps;
+    host_step_struct step = heat_up(steps, 5);
+    step.boost = true;
+    steps.push_back(step);
+    step.boost = false;
+    ramp(steps, 20, step, 31);
+    hold(steps, 60, step);
+    ramp(steps, 10, step, 28);
+    hold(steps, 20, step);
+    return steps;
+}
+struct scenario_struct
+{
+    const char *name;
+    sequence_type (*steps)();
+};
+static const scenario_struct scenarios[] = {
+    {"cold_start", cold_start},
+    {"sww_during_run", sww_during_run},
+    {"defrost_during_stall", defrost_during_stall},
+    {"thermostat_off_in_minimum_run", thermostat_off_in_minimum_run},
+    {"boost_expiry", boost_expiry},
+};
+// the trace csv, the digest and where the scenario ended
+static std::string replay(const scenario_struct &scenario)
+{
+    host_reset();
+    sequence_type steps = scenario.steps();
+    for (const host_step_struct &step : steps)
+        host_cycle(step);
+    std::string out;
+    transition_trace.print(out);
+    char line[128];
+    snprintf(line, sizeof(line), "cycles %zu\nstate %s\nlg_trace_digest %u\n", steps.size(), fsm.state_name(), (unsigned)transition_trace.digest.load());
+    out += line;
+    return out;
+}
+static std::string read_file(const std::string &path)
+{
+    std::ifstream file(path);
+    std::stringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+// first line that differs, for the report
+static void print_difference(const std::string &expected, const std::string &actual)
+{
+    std::istringstream expected_lines(expected), actual_lines(actual);
+    std::string expected_line, actual_line;
+    for (int number = 1;; number++)
+    {
+        bool more_expected = (bool)std::getline(expected_lines, expected_line);
+        bool more_actual = (bool)std::getline(actual_lines, actual_line);
+        if (!more_expected && !more_actual)
+            return;
+        if (!more_expected || !more_actual || expected_line != actual_line)
+        {
+            printf("  line %d\n  golden: %s\n  now:    %s\n", number, more_expected ? expected_line.c_str() : "(end)", more_actual ? actual_line.c_str() : "(end)");
+            return;
+        }
+    }
+}
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: golden DIR [--update]\n");
+        return 2;
+    }
+    std::string directory = argv[1];
+    bool update = argc > 2 && strcmp(argv[2], "--update") == 0;
+    const int count = sizeof(scenarios) / sizeof(scenarios[0]);
+    // one process per scenario, each writes its trace into a pipe
+    int pipes[count];
+    pid_t children[count];
+    fflush(stdout);
+    for (int i = 0; i < count; i++)
+    {
+        int fds[2];
+        if (pipe(fds) != 0)
+            return 2;
+        children[i] = fork();
+        if (children[i] == 0)
+        {
+            close(fds[0]);
+            std::string out = replay(scenarios[i]);
+            ssize_t written = write(fds[1], out.data(), out.size());
+            _exit(written == (ssize_t)out.size() ? 0 : 2);
+        }
+        close(fds[1]);
+        pipes[i] = fds[0];
+    }
+    int failures = 0;
+    for (int i = 0; i < count; i++)
+    {
+        std::string actual;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(pipes[i], buffer, sizeof(buffer))) > 0)
+            actual.append(buffer, n);
+        close(pipes[i]);
+        int status = 0;
+        waitpid(children[i], &status, 0);
+        std::string path = directory + "/" + scenarios[i].name + ".txt";
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            printf("%-32s worker failed\n", scenarios[i].name);
+            failures++;
+        }
+        else if (update)
+        {
+            std::ofstream(path) << actual;
+            printf("%-32s written\n", scenarios[i].name);
+        }
+        else
+        {
+            std::string expected = read_file(path);
+            bool same = expected == actual;
+            printf("%-32s %s\n", scenarios[i].name, same ? "ok" : (expected.empty() ? "no golden file" : "differs"));
+            if (!same)
+            {
+                print_difference(expected, actual);
+                failures++;
+            }
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
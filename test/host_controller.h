@@ -0,0 +1,200 @@
+#pragma once
+// the controller on the host: fsm, metrics and the entities are globals of the state machine translation unit, so every
+// test program is one translation unit that includes this header once. Runs are separated with host_reset(), parallel
+// runs use processes (fork), never threads
+#include "esphome_stub.h"
+#include <new>
+#include "lg-monoblock-modbus-state-machine.cpp"
+
+// initial values of base.yml
+host_number backup_heater_active_temp{-10}, backup_heater_always_on_temp{-6}, boost_time{60}, external_pump_runover{10}, minimum_run_time{30}, oat_silent_always_off{2}, oat_silent_always_on{6}, stooklijn_curve{0}, stooklijn_max_oat{16}, stooklijn_max_wtemp{35}, stooklijn_min_oat{-18}, stooklijn_min_wtemp{25}, thermostat_off_delay{1}, thermostat_on_delay{0}, water_temp_target_output{30}, wp_stooklijn_offset{0}, room_temp_target{20};
+host_sensor defrost_prediction, buiten_temp, compressor_rpm, compressor_hz, derivative_value, doel_temp, water_temp_aanvoer, water_temp_retour, watertemp_target, binnen_temp, current_flow_rate, room_compensation_value, building_heat_loss_value, building_time_constant_value;
+host_switch boost_switch, relay_backup_heat, relay_heat, relay_pump, silent_mode_switch;
+host_binary_sensor compressor_running, defrosting, pump_running, silent_mode_state, sww_heating, thermostat_signal;
+host_text_sensor controller_info, controller_state;
+host_interval state_machine;
+float building_heat_loss = 0, building_time_constant = 0, building_emitter_coefficient = 0;
+uint32_t building_model_samples = 0;
+
+// controller as constructed at boot, every run starts from it
+static const state_machine_class host_pristine = fsm;
+
+// entities whose state the controller reads or writes
+static host_sensor *const host_sensors[] = {&defrost_prediction, &buiten_temp, &compressor_rpm, &compressor_hz, &derivative_value, &doel_temp, &water_temp_aanvoer, &water_temp_retour, &watertemp_target, &binnen_temp, &current_flow_rate, &room_compensation_value, &building_heat_loss_value, &building_time_constant_value};
+static host_binary_sensor *const host_binary_sensors[] = {&compressor_running, &defrosting, &pump_running, &silent_mode_state, &sww_heating, &thermostat_signal};
+static host_switch *const host_switches[] = {&boost_switch, &relay_backup_heat, &relay_heat, &relay_pump, &silent_mode_switch};
+static const int host_sensor_count = sizeof(host_sensors) / sizeof(host_sensors[0]);
+static const int host_binary_sensor_count = sizeof(host_binary_sensors) / sizeof(host_binary_sensors[0]);
+static const int host_switch_count = sizeof(host_switches) / sizeof(host_switches[0]);
+
+// back to boot: controller, telemetry, entities and clock. The callbacks the controller registered stay
+static void host_reset()
+{
+    fsm.restore(host_pristine);
+    metrics.~metrics_struct();
+    new (&metrics) metrics_struct();
+    transition_trace.count.store(0);
+    transition_trace.digest.store(2166136261u);
+    for (int i = 0; i < SENSOR_COUNT; i++)
+    {
+        sensor_updated_ms[i] = 0;
+        sensor_seen[i] = false;
+    }
+    host_ms = 0;
+    for (host_sensor *sensor : host_sensors)
+    {
+        sensor->state = NAN;
+        sensor->has = false;
+    }
+    for (host_binary_sensor *sensor : host_binary_sensors)
+    {
+        sensor->state = false;
+        sensor->has = false;
+    }
+    for (host_switch *item : host_switches)
+        item->state = false;
+    controller_info = host_text_sensor();
+    controller_state = host_text_sensor();
+    water_temp_target_output.state = 30;
+    building_heat_loss = building_time_constant = building_emitter_coefficient = 0;
+    building_model_samples = 0;
+}
+// everything a cycle depends on, to continue a run from any point (fork() covers the controller only)
+struct host_snapshot_struct
+{
+    state_machine_class controller;
+    uint32_t ms = 0;
+    uint32_t updated_ms[SENSOR_COUNT] = {};
+    bool seen[SENSOR_COUNT] = {};
+    float sensor_states[host_sensor_count] = {};
+    bool sensor_has[host_sensor_count] = {};
+    bool binary_sensor_states[host_binary_sensor_count] = {};
+    bool binary_sensor_has[host_binary_sensor_count] = {};
+    bool switch_states[host_switch_count] = {};
+    float target_output = NAN;
+};
+static inline void host_save(host_snapshot_struct &snapshot)
+{
+    snapshot.controller = fsm.fork();
+    snapshot.ms = host_ms;
+    memcpy(snapshot.updated_ms, sensor_updated_ms, sizeof(snapshot.updated_ms));
+    memcpy(snapshot.seen, sensor_seen, sizeof(snapshot.seen));
+    for (int i = 0; i < host_sensor_count; i++)
+    {
+        snapshot.sensor_states[i] = host_sensors[i]->state;
+        snapshot.sensor_has[i] = host_sensors[i]->has;
+    }
+    for (int i = 0; i < host_binary_sensor_count; i++)
+    {
+        snapshot.binary_sensor_states[i] = host_binary_sensors[i]->state;
+        snapshot.binary_sensor_has[i] = host_binary_sensors[i]->has;
+    }
+    for (int i = 0; i < host_switch_count; i++)
+        snapshot.switch_states[i] = host_switches[i]->state;
+    snapshot.target_output = water_temp_target_output.state;
+}
+static inline void host_load(const host_snapshot_struct &snapshot)
+{
+    fsm.restore(snapshot.controller);
+    host_ms = snapshot.ms;
+    memcpy(sensor_updated_ms, snapshot.updated_ms, sizeof(snapshot.updated_ms));
+    memcpy(sensor_seen, snapshot.seen, sizeof(snapshot.seen));
+    for (int i = 0; i < host_sensor_count; i++)
+    {
+        host_sensors[i]->state = snapshot.sensor_states[i];
+        host_sensors[i]->has = snapshot.sensor_has[i];
+    }
+    for (int i = 0; i < host_binary_sensor_count; i++)
+    {
+        host_binary_sensors[i]->state = snapshot.binary_sensor_states[i];
+        host_binary_sensors[i]->has = snapshot.binary_sensor_has[i];
+    }
+    for (int i = 0; i < host_switch_count; i++)
+        host_switches[i]->state = snapshot.switch_states[i];
+    water_temp_target_output.state = snapshot.target_output;
+}
+
+// what the heat pump and the house report in one cycle, plus outside interference
+struct host_step_struct
+{
+    bool thermostat = false;
+    bool compressor = false;
+    bool defrost = false;
+    bool sww = false;
+    bool boost = false;      // boost switched on from Home Assistant
+    bool meddle = false;     // relay_heat switched by hand before the cycle
+    bool modbus_down = false; // no modbus poll this cycle, the sensors keep their last state
+    float oat = 5;
+    float supply = 30;
+    float compressor_hz = 0;
+};
+// the last cycle was refused on stale sensors, it held the state and the outputs
+static bool host_cycle_held = false;
+// the modbus poll of a 30 s interval: publishes the sensors (the binary sensors through their lambda) and the inputs from
+// Home Assistant
+static inline void host_poll(const host_step_struct &step)
+{
+    host_ms += 30000;
+    thermostat_signal.publish_state(step.thermostat);
+    if (step.boost)
+        boost_switch.turn_on();
+    if (step.meddle)
+        relay_heat.state = !relay_heat.state;
+    if (!step.modbus_down)
+    {
+        for (snapshot_sensors sensor : {SENSOR_COMPRESSOR_RUNNING, SENSOR_DEFROSTING, SENSOR_SWW_HEATING, SENSOR_PUMP_RUNNING})
+            fsm.sensor_read(sensor);
+        compressor_running.publish_state(step.compressor);
+        defrosting.publish_state(step.defrost);
+        sww_heating.publish_state(step.sww);
+        pump_running.publish_state(relay_pump.state || step.compressor);
+        buiten_temp.publish_state(step.oat);
+        water_temp_aanvoer.publish_state(step.supply);
+        water_temp_retour.publish_state(step.supply - 3);
+        compressor_hz.publish_state(step.compressor ? step.compressor_hz : 0);
+        compressor_rpm.publish_state(compressor_hz.state);
+        current_flow_rate.publish_state(relay_pump.state || step.compressor ? 20 : 0);
+        binnen_temp.publish_state(20);
+    }
+}
+// one 30 s interval: the poll, then the interval runs the cycle
+static void host_cycle(const host_step_struct &step)
+{
+    host_poll(step);
+    uint32_t stale_cycles = metrics.stale_cycles.load();
+#ifdef LG_DUAL_CORE
+    // one cycle at a time on the control thread, then the ESPHome loop applies its outputs
+    uint32_t done = control_cycles_done.load();
+    fsm.run_cycle();
+    while (control_cycles_done.load() == done)
+        std::this_thread::yield();
+    fsm.apply_outputs();
+#else
+    fsm.run_cycle();
+#endif // LG_DUAL_CORE
+    host_cycle_held = metrics.stale_cycles.load() != stale_cycles;
+}
+
+// the actuator invariants every cycle must end with, returns the violated one or nullptr
+// state_before is the state at the start of the cycle, enforced outputs only hold in a state that was not just entered
+static inline const char *host_check_invariants(states state_before)
+{
+    if (relay_heat.state && !relay_pump.state)
+        return "relay_heat on without relay_pump";
+    if (relay_backup_heat.state && !(relay_heat.state && relay_pump.state))
+        return "relay_backup_heat on without relay_heat and relay_pump";
+    states state = fsm.state();
+    if (state <= NONE || state > AFTERRUN)
+        return "state out of range";
+    if (metrics.sequence_pool_exhausted.load() != 0)
+        return "sequence frame pool exhausted";
+    // INIT does not read the inputs before it is done, it can not see a switch turned on from Home Assistant
+    if (state != state_before || state == INIT || host_cycle_held)
+        return nullptr;
+    // ENFORCE CONFIG of the states
+    if (relay_backup_heat.state && (state == IDLE || state == START || state == STARTING || state == STABILIZE || state == OVERSHOOT || state == AFTERRUN))
+        return "backup heat on in a state that enforces it off";
+    if (boost_switch.state && (state == IDLE || state == STARTING || state == STABILIZE || state == AFTERRUN))
+        return "boost on in a state that enforces it off";
+    return nullptr;
+}
@@ -0,0 +1,186 @@
+// /metrics must stay valid prometheus text: every line is a HELP or TYPE comment or a sample of a declared family, the
+// samples of a family are together and no snprintf into the fixed line buffers may truncate. Checked after a run and with
+// every counter at its widest value
+#include "host_controller.h"
+#include <cctype>
+#include <map>
+#include <sstream>
+
+static bool valid_name(const std::string &name)
+{
+    if (name.empty() || !(isalpha((unsigned char)name[0]) || name[0] == '_' || name[0] == ':'))
+        return false;
+    for (char c : name)
+    {
+        if (!(isalnum((unsigned char)c) || c == '_' || c == ':'))
+            return false;
+    }
+    return true;
+}
+// label set without the braces: name="value",name="value"
+static bool valid_labels(const std::string &labels)
+{
+    size_t i = 0;
+    while (i < labels.size())
+    {
+        size_t equals = labels.find('=', i);
+        if (equals == std::string::npos || !valid_name(labels.substr(i, equals - i)) || equals + 1 >= labels.size() || labels[equals + 1] != '"')
+            return false;
+        size_t close = labels.find('"', equals + 2);
+        if (close == std::string::npos)
+            return false;
+        i = close + 1;
+        if (i < labels.size())
+        {
+            if (labels[i] != ',')
+                return false;
+            i++;
+        }
+    }
+    return true;
+}
+static bool valid_value(const std::string &value)
+{
+    if (value == "+Inf" || value == "-Inf" || value == "NaN")
+        return true;
+    char *end = nullptr;
+    strtod(value.c_str(), &end);
+    return !value.empty() && *end == '\0';
+}
+// family a sample belongs to: histograms and summaries add _bucket, _sum and _count
+static std::string family_of(const std::string &name, const std::map<std::string, std::string> &types)
+{
+    if (types.count(name))
+        return name;
+    for (const char *suffix : {"_bucket", "_sum", "_count"})
+    {
+        size_t length = strlen(suffix);
+        if (name.size() > length && name.compare(name.size() - length, length, suffix) == 0)
+        {
+            std::string base = name.substr(0, name.size() - length);
+            auto type = types.find(base);
+            if (type != types.end() && (type->second == "histogram" || type->second == "summary"))
+                return base;
+        }
+    }
+    return "";
+}
+// returns the number of malformed lines, prints the first ones
+static int check(const std::string &text, const char *label)
+{
+    int errors = 0;
+    auto error = [&](int number, const std::string &line, const char *problem)
+    {
+        if (errors++ < 10)
+            printf("%s: line %d %s: %s\n", label, number, problem, line.c_str());
+    };
+    if (text.empty() || text.back() != '\n')
+        error(0, "", "output does not end with a newline");
+    std::map<std::string, std::string> types;
+    std::map<std::string, int> samples;
+    std::map<std::string, bool> finished; // families whose samples ended, another sample is out of its group
+    std::string current_family;
+    std::istringstream lines(text);
+    std::string line;
+    int number = 0;
+    while (std::getline(lines, line))
+    {
+        number++;
+        if (line.rfind("# HELP ", 0) == 0)
+        {
+            std::string rest = line.substr(7);
+            size_t space = rest.find(' ');
+            if (space == std::string::npos || !valid_name(rest.substr(0, space)) || space + 1 >= rest.size())
+                error(number, line, "malformed HELP");
+            continue;
+        }
+        if (line.rfind("# TYPE ", 0) == 0)
+        {
+            std::istringstream fields(line.substr(7));
+            std::string name, type, extra;
+            fields >> name >> type >> extra;
+            if (!valid_name(name) || !extra.empty() || (type != "counter" && type != "gauge" && type != "histogram" && type != "summary" && type != "untyped"))
+                error(number, line, "malformed TYPE");
+            else if (types.count(name))
+                error(number, line, "family declared twice");
+            else
+                types[name] = type;
+            continue;
+        }
+        if (line.empty() || line[0] == '#')
+        {
+            error(number, line, "empty or unknown comment line");
+            continue;
+        }
+        size_t name_end = line.find_first_of("{ ");
+        if (name_end == std::string::npos)
+        {
+            error(number, line, "sample without value");
+            continue;
+        }
+        std::string name = line.substr(0, name_end);
+        size_t value_start = name_end;
+        if (line[name_end] == '{')
+        {
+            size_t close = line.find("} ", name_end);
+            if (close == std::string::npos || !valid_labels(line.substr(name_end + 1, close - name_end - 1)))
+            {
+                error(number, line, "malformed labels");
+                continue;
+            }
+            value_start = close + 1;
+        }
+        std::string value = line.substr(value_start + 1);
+        if (!valid_name(name) || !valid_value(value))
+            error(number, line, "malformed sample");
+        else if (family_of(name, types).empty())
+            error(number, line, "sample without a TYPE before it");
+        else if (samples[line.substr(0, value_start)]++ > 0)
+            error(number, line, "duplicate series");
+        else if (family_of(name, types) != current_family)
+        {
+            if (finished[family_of(name, types)])
+                error(number, line, "family split in two groups");
+            finished[current_family] = true;
+            current_family = family_of(name, types);
+        }
+    }
+    printf("%s: %d lines, %zu families, %d errors\n", label, number, types.size(), errors);
+    return errors;
+}
+int main()
+{
+    // a day with heat demand, compressor starts, a defrost and SWW to get non zero counters, histograms and transitions
+    host_reset();
+    for (int cycle = 0; cycle < 2 * 60 * 24; cycle++)
+    {
+        host_step_struct step;
+        step.thermostat = (cycle / 240) % 3 != 0;
+        step.compressor = step.thermostat && (cycle / 20) % 7 != 0;
+        step.defrost = cycle % 600 > 590;
+        step.sww = cycle % 900 > 880;
+        step.oat = -5 + (cycle % 200) / 20.0f;
+        step.supply = 25 + (cycle % 40) / 4.0f;
+        step.compressor_hz = 40 + cycle % 50;
+        host_cycle(step);
+    }
+    std::string out;
+    metrics.print(out);
+    int errors = check(out, "after a day");
+    // every counter at its widest value: a line that does not fit its buffer is cut and runs into the next one
+    const uint32_t *bounds[] = {metrics.cycle_time_us.bounds, metrics.modbus_latency_us.bounds, metrics.handoff_latency_us.bounds};
+    const uint32_t *phase_bounds[5];
+    for (int i = 0; i < 5; i++)
+        phase_bounds[i] = metrics.phase_time_us[i].bounds;
+    memset((void *)&metrics, 0xff, sizeof(metrics));
+    metrics.cycle_time_us.bounds = bounds[0];
+    metrics.modbus_latency_us.bounds = bounds[1];
+    metrics.handoff_latency_us.bounds = bounds[2];
+    for (int i = 0; i < 5; i++)
+        metrics.phase_time_us[i].bounds = phase_bounds[i];
+    transition_trace.digest.store(UINT32_MAX);
+    out.clear();
+    metrics.print(out);
+    errors += check(out, "saturated");
+    return errors == 0 ? 0 : 1;
+}